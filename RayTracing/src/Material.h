@@ -0,0 +1,13 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+struct Material
+{
+	glm::vec3 Color{ 1.0f };
+	float Roughness = 1.0f;
+	float Emission = 0.0f;
+};
+
+// .oct files store the materials as laid out in memory
+static_assert(sizeof(Material) == 20, "Material layout changed, bump the .oct version");
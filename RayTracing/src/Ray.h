@@ -1,5 +1,7 @@
 #pragma once
 
+#include "Material.h"
+
 #include <glm/glm.hpp>
 
 struct Ray
@@ -15,7 +17,14 @@ struct OctreeNode;
 
 struct RayHit
 {
-	OctreeNode* Node;
+	OctreeNode* Node; // Standard layout only
+	uint32_t Data;
 	glm::vec3 Position;
 	glm::vec3 Normal;
+
+	// Along the ray to where it enters the hit voxel, set by the HLBVH and Tree64
+	float Distance;
+
+	// Resolved once per hit, only the averaged colour on LOD stops
+	Material Surface;
 };
@@ -5,13 +5,16 @@
 
 #include "utils/Loader.h"
 #include "utils/Utils.h"
+#include "utils/ThreadPool.h"
 
 #include <glm/gtx/string_cast.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
 
-#include <thread>
-
+// One instance per HLBVH leaf, every instance in a leaf costs a full octree traversal.
+// Wider leaves only save build time: 250 per leaf builds 100k instances 2x faster but traces 11x slower.
 Renderer::Renderer()
-	: m_Octrees(), m_HLBVH(m_Octrees, 250)
+	: m_Octrees(), m_Instances(), m_HLBVH(m_Octrees, m_Instances, 1)
 {
 	// Walnut::Random::Init();
 
@@ -19,43 +22,38 @@ Renderer::Renderer()
 	{
 		// Octree* octree = Loader::load_vox("./models/model_16_1.vox", m_Octrees);
 
-		{
-			Octree* octree = Loader::load_oct("./models/octrees/frame.oct", m_Octrees);
-			
-			octree->m_Position = glm::vec3{ 0, 0, 0 };
-		}
-
-		{
-			Octree* octree = Loader::load_oct("./models/octrees/car.oct", m_Octrees);
-
-			octree->m_Position = glm::vec3{ 32, 0, 32 };
-		}
+		// Every model is loaded once, the BVH only places instances of it
+		uint32_t frame = (uint32_t) m_Octrees.size();
+		Loader::load_oct("./models/octrees/frame.oct", m_Octrees);
 
-		{
-			Octree* octree = Loader::load_oct("./models/octrees/model_16.oct", m_Octrees);
-			
-			octree->m_Position = glm::vec3{ 16, 0, -8 };
-		}
+		uint32_t car = (uint32_t) m_Octrees.size();
+		Loader::load_oct("./models/octrees/car.oct", m_Octrees);
 
-		{
-			Octree* octree = Loader::load_oct("./models/octrees/model_32.oct", m_Octrees);
+		uint32_t model_16 = (uint32_t) m_Octrees.size();
+		Loader::load_oct("./models/octrees/model_16.oct", m_Octrees);
 
-			octree->m_Position = glm::vec3{ 48, 0, 16 };
-		}
+		uint32_t model_32 = (uint32_t) m_Octrees.size();
+		Loader::load_oct("./models/octrees/model_32.oct", m_Octrees);
 
-		{
-			Octree* octree = Loader::load_oct("./models/octrees/model_16_1.oct", m_Octrees);
+		uint32_t model_16_1 = (uint32_t) m_Octrees.size();
+		Loader::load_oct("./models/octrees/model_16_1.oct", m_Octrees);
 
-			octree->m_Position = glm::vec3{ -8, 0, 24 };
-		}
+		m_Instances.emplace_back(frame,      glm::translate(glm::mat4(1.0f), glm::vec3{ 0, 0, 0 }));
+		m_Instances.emplace_back(car,        glm::translate(glm::mat4(1.0f), glm::vec3{ 32, 0, 32 }));
+		m_Instances.emplace_back(model_16,   glm::translate(glm::mat4(1.0f), glm::vec3{ 16, 0, -8 }));
+		m_Instances.emplace_back(model_32,   glm::translate(glm::mat4(1.0f), glm::vec3{ 48, 0, 16 }));
+		m_Instances.emplace_back(model_16_1, glm::translate(glm::mat4(1.0f), glm::vec3{ -8, 0, 24 }));
 
+		// Scattered props, turned around their center and scaled
+		for (uint8_t i = 0; i < 20; i++)
 		{
-			for (uint8_t i = 0; i < 20; i++)
-			{
-				Octree* octree = Loader::load_oct("./models/octrees/model_16.oct", m_Octrees);
+			glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3{ Walnut::Random::UInt(64, 256), 0, Walnut::Random::UInt(64, 256) });
+			transform = glm::scale(transform, glm::vec3(0.5f + Walnut::Random::Float()));
+			transform = glm::translate(transform, glm::vec3(8, 0, 8));
+			transform = glm::rotate(transform, Walnut::Random::Float() * glm::two_pi<float>(), glm::vec3(0, 1, 0));
+			transform = glm::translate(transform, glm::vec3(-8, 0, -8));
 
-				octree->m_Position = glm::vec3{ Walnut::Random::UInt(64, 256), 0, Walnut::Random::UInt(64, 256) };
-			}
+			m_Instances.emplace_back(model_16, transform);
 		}
 
 		/*
@@ -137,8 +135,9 @@ Renderer::Renderer()
 		ray.InvDirection = glm::vec3(1) / ray.Direction;
 		ray.MaxDistance = 100;
 
+		RayHit hit;
 		for (uint32_t i = 0; i < count; i++)
-			auto [node, pos, norm] = m_Octrees[0].ray_travel(ray);
+			m_Octrees[0].ray_travel(ray, &hit);
 
 		totTime += t.ElapsedMillis();
 	}
@@ -147,6 +146,68 @@ Renderer::Renderer()
 #endif
 }
 
+void Renderer::BenchmarkTree64(Octree& octree)
+{
+	Walnut::Timer t;
+
+	Tree64 tree;
+	tree.build(octree);
+	float buildTime = t.ElapsedMillis();
+
+	// Grid of rays from a corner towards the model center plane, close enough that the octree takes no LOD stops
+	glm::vec3 size = octree.m_Nodes[0].top_corner + glm::vec3(1);
+	glm::vec3 origin = { -size.x * 0.1f, size.y * 1.1f, -size.z * 0.1f };
+
+	std::vector<Ray> rays;
+	uint32_t grid = 256;
+	for (uint32_t y = 0; y < grid; y++)
+		for (uint32_t x = 0; x < grid; x++)
+		{
+			Ray ray{};
+			ray.Origin = origin;
+			ray.Direction = glm::normalize(glm::vec3((x + 0.5f) / grid * size.x, (y + 0.5f) / grid * size.y, size.z * 0.5f) - origin);
+			ray.InvDirection = glm::vec3(1) / ray.Direction;
+			ray.MaxDistance = 500;
+			rays.push_back(ray);
+		}
+
+	// Both structures have to agree before their timings mean anything
+	uint32_t hits = 0, mismatches = 0;
+	RayHit octreeHit, treeHit;
+	for (const Ray& ray : rays)
+	{
+		bool octreeFound = octree.ray_travel(ray, &octreeHit);
+		bool treeFound = tree.ray_travel(ray, &treeHit);
+
+		hits += octreeFound;
+		if (octreeFound != treeFound || (octreeFound && octreeHit.Position != treeHit.Position))
+			mismatches++;
+	}
+
+	uint32_t step = 20;
+	float octreeTime = 0, treeTime = 0;
+	for (uint32_t i = 0; i < step; i++)
+	{
+		t.Reset();
+		for (const Ray& ray : rays)
+			octree.ray_travel(ray, &octreeHit);
+		octreeTime += t.ElapsedMillis();
+
+		t.Reset();
+		for (const Ray& ray : rays)
+			tree.ray_travel(ray, &treeHit);
+		treeTime += t.ElapsedMillis();
+	}
+
+	float octreeKB = octree.m_Nodes.size() * sizeof(OctreeNode) / 1024.0f;
+	float treeKB = (tree.m_Nodes.size() * sizeof(Tree64Node) + tree.m_MaterialIds.size() * sizeof(uint16_t)) / 1024.0f;
+	float rayCount = (float) rays.size() * step;
+
+	std::cout << "Tree64 built in " << buildTime << "ms | Octree " << octreeKB << " KB, " << (rayCount / octreeTime / 1000.0f) << " Mrays/s"
+		<< " | Tree64 " << treeKB << " KB, " << (rayCount / treeTime / 1000.0f) << " Mrays/s"
+		<< " | " << rays.size() << " rays, " << hits << " hits, " << mismatches << " mismatches" << std::endl;
+}
+
 void Renderer::OnResize(uint32_t width, uint32_t height)
 {
 	if (m_FinalImage)
@@ -171,51 +232,37 @@ void Renderer::Render(const Scene& scene, const Camera& camera, bool& render_lig
 	m_ActiveScene = &scene;
 	m_ActiveCamera = &camera;
 
-	std::vector<std::thread> threads;
-	unsigned char num_threads = 6; // Default 6
+	ThreadPool& pool = ThreadPool::Get();
 
 	uint32_t imageW = m_FinalImage->GetWidth(), imageH = m_FinalImage->GetHeight();
 
-	uint32_t stepX = imageW / num_threads;
-	uint32_t stepY = imageH / num_threads;
-	
-	float totMs = 0;
-	for (unsigned char j = 0; j < num_threads; j++)
-	{
-		uint32_t startY = stepY * j, endY = j + 1 == num_threads ? imageH : stepY * (j + 1);
+	uint32_t tilesX = (imageW + TILE_SIZE - 1) / TILE_SIZE;
+	uint32_t tilesY = (imageH + TILE_SIZE - 1) / TILE_SIZE;
+
+	Walnut::Timer renderTimer;
 
-		for (unsigned char i = 0; i < num_threads; i++)
+	pool.ParallelFor(tilesX * tilesY, [this, tilesX, imageW, imageH, &render_light, &render_normal](uint32_t tile) {
+		uint32_t startX = (tile % tilesX) * TILE_SIZE, endX = std::min(startX + TILE_SIZE, imageW);
+		uint32_t startY = (tile / tilesX) * TILE_SIZE, endY = std::min(startY + TILE_SIZE, imageH);
+
+		for (uint32_t y = startY; y < endY; y++)
 		{
-			threads.emplace_back([this, &stepX, i, startY, endY, &imageW, &imageH, &num_threads, &totMs, &render_light, &render_normal]() {
-				Walnut::Timer t;
-				
-				uint32_t startX = stepX * i;
-				uint32_t endX = i + 1 == num_threads ? imageW : stepX * (i + 1);
+			for (uint32_t x = startX; x < endX; x++)
+			{
+				glm::vec4 color = PerPixel(x, y, render_light, render_normal);
 
-				for (uint32_t y = startY; y < endY; y++)
-				{
-					for (uint32_t x = startX; x < endX; x++)
-					{
-						glm::vec4 color = PerPixel(x, y, render_light, render_normal);
-
-						// Crosshair
-						if (std::abs(imageW / 2.0f - x) < 3 &&
-							std::abs(imageH / 2.0f - y) < 3)
-							color = glm::vec4(1.0, 0.0, 0.0, 1.0);
-
-						color = glm::clamp(color, glm::vec4(0.0f), glm::vec4(1.0f));
-						m_ImageData[x + y * imageW] = Utils::Vec4ToRGBA(color);
-					}
-				}
+				// Crosshair
+				if (std::abs(imageW / 2.0f - x) < 3 &&
+					std::abs(imageH / 2.0f - y) < 3)
+					color = glm::vec4(1.0, 0.0, 0.0, 1.0);
 
-				totMs += t.ElapsedMillis();
-			});
+				color = glm::clamp(color, glm::vec4(0.0f), glm::vec4(1.0f));
+				m_ImageData[x + y * imageW] = Utils::Vec4ToRGBA(color);
+			}
 		}
-	}
+	});
 
-	for (auto& thread : threads) {
-		thread.join();
-	}
+	float totMs = renderTimer.ElapsedMillis();
 
 	// Draw Gizmo Octrees
 	float gizmo_render = 0;
@@ -223,8 +270,8 @@ void Renderer::Render(const Scene& scene, const Camera& camera, bool& render_lig
 	{
 		Walnut::Timer t;
 
-		for (Octree& octree : m_Octrees)
-			DrawOctree(octree, 0);
+		for (const OctreeInstance& instance : m_Instances)
+			DrawOctree(m_Octrees[instance.asset], instance.transform, 0);
 
 		gizmo_render += t.ElapsedMillis();
 	}
@@ -234,27 +281,33 @@ void Renderer::Render(const Scene& scene, const Camera& camera, bool& render_lig
 	{
 		Walnut::Timer t;
 
-		DrawHLBVH(m_HLBVH.GetNodeIterator(), -1);
+		if (LinearBVHNode* nodes = m_HLBVH.GetNodeIterator())
+			DrawHLBVH(nodes, -1);
 
 		gizmo_render += t.ElapsedMillis();
 	}
 #endif
 
 	std::cout << "Render (" << imageW << "x" << imageH << ") in "
-		<< totMs << "ms (" << (totMs / (num_threads * num_threads)) << " ms each) Gizmo: " << gizmo_render << std::endl;
+		<< totMs << "ms (" << (tilesX * tilesY) << " tiles on " << pool.GetThreadCount() << " threads) Gizmo: " << gizmo_render << std::endl;
 
 	m_FinalImage->SetData(m_ImageData);
 }
 
-void Renderer::DrawOctree(Octree& octree, int depth, uint32_t index)
+void Renderer::DrawOctree(Octree& octree, const glm::mat4& transform, int depth, uint32_t index)
 {
-	DrawQuad(octree.m_Nodes[index].bottom_corner + octree.m_Position,
-			 octree.m_Nodes[index].top_corner    + octree.m_Position,
+	const OctreeNode& node = octree.m_Nodes[index];
+
+	glm::vec3 bottom, top;
+	Utils::TransformAABB(transform, glm::vec3{ node.bottom_corner.x, node.bottom_corner.y, node.bottom_corner.z },
+									glm::vec3{ node.top_corner.x, node.top_corner.y, node.top_corner.z }, bottom, top);
+
+	DrawQuad(bottom, top,
 			Loader::PALETTE[((depth < 0 ? -depth : depth) * 321 + 876) % 256]);
 
 	if (depth != 0 && octree.m_Nodes[index].first_child != -1)
 		for (uint8_t i = 0; i < octree.m_Nodes[index].child_count(); i++)
-			DrawOctree(octree, depth - 1, octree.m_Nodes[index].first_child + i);
+			DrawOctree(octree, transform, depth - 1, octree.m_Nodes[index].first_child + i);
 }
 
 void Renderer::DrawHLBVH(LinearBVHNode* node, int depth, uint32_t index)
@@ -395,13 +448,10 @@ glm::vec4 Renderer::PerPixel(uint32_t x, uint32_t y, bool& render_light, bool& r
 		// sphereColor *= lightIntensity;
 		// color += sphereColor * multiplier;
 
-		if (paylod.OctreeNode)
-			if(render_normal)
-				color = (paylod.WorldNormal + 1.0f) / 2.0f;
-			else
-				color = paylod.OctreeNode->get_color() * (render_light ? lightIntensity : 1.0f);
+		if(render_normal)
+			color = (paylod.WorldNormal + 1.0f) / 2.0f;
 		else
-			color = glm::vec3(1, 0, 1) * lightIntensity;
+			color = paylod.Surface.Color * ((render_light ? lightIntensity : 1.0f) + paylod.Surface.Emission);
 
 		if (i == 1)
 			break;
@@ -423,6 +473,7 @@ bool Renderer::VoxelTraceRay(Ray& ray, HitPaylod& paylod)
 	{
 		paylod.WorldPosition = hit.Position;
 		paylod.OctreeNode = hit.Node;
+		paylod.Surface = hit.Surface;
 		paylod.WorldNormal = hit.Normal;
 		return true;
 	}
@@ -16,6 +16,9 @@ class Renderer
 {
 #define INDEX(x, y, z) x + (y * m_VoxelSize) + (z * m_VoxelSize * m_VoxelSize)
 
+	// Screen tile side handed to the thread pool as one task
+	static constexpr uint32_t TILE_SIZE = 32;
+
 public:
 	Renderer();
 
@@ -24,17 +27,21 @@ public:
 	
 	std::shared_ptr<Walnut::Image> GetFinalImage() const { return m_FinalImage; }
 
+	// Builds a Tree64 of the Standard layout octree, prints its build time, memory and ray throughput next to the octree
+	void BenchmarkTree64(Octree& octree);
+
 private:
 	struct HitPaylod
 	{
 		OctreeNode* OctreeNode;
+		Material Surface;
 		glm::vec3 WorldPosition;
 		glm::vec3 WorldNormal;
 
 		int ObjectIndex;
 	};
 
-	void DrawOctree(Octree& octree, int depth = 3, uint32_t index = 0);
+	void DrawOctree(Octree& octree, const glm::mat4& transform, int depth = 3, uint32_t index = 0);
 	void DrawHLBVH(LinearBVHNode* node, int depth, uint32_t index = 0);
 
 	void DrawQuad(glm::vec3& p0, glm::vec3& p1, uint32_t color);
@@ -58,6 +65,8 @@ private:
 	uint32_t* m_ImageData = nullptr;
 
 public:
+	// Shared assets, placed in the scene by m_Instances
 	std::vector<Octree> m_Octrees;
+	std::vector<OctreeInstance> m_Instances;
 	HLBVH m_HLBVH;
 };
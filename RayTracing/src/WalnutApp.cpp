@@ -103,8 +103,63 @@ public:
 			ImGui::PushID(i);
 
 			Octree& octree = m_Renderer.m_Octrees[i];
-			float d = glm::distance(octree.m_Nodes[0].top_corner + glm::vec3(1) / 2.0f, m_Camera.GetPosition() - octree.m_Position);
-			ImGui::Text("Octree %i: %.2f - Max Depth: %i", i, d, Utils::GetLOD(d, octree.m_Nodes[0].top_corner.max(), octree.m_MaxDepth));
+
+			// Distance to the closest instance of the asset, in octree space
+			int instances = 0;
+			float d = FLT_MAX;
+			for (const OctreeInstance& instance : m_Renderer.m_Instances)
+			{
+				if (instance.asset != i)
+					continue;
+
+				instances++;
+				glm::vec3 camera = glm::vec3(instance.inv_transform * glm::vec4(m_Camera.GetPosition(), 1.0f));
+				d = std::min(d, glm::distance(octree.m_Nodes[0].top_corner + glm::vec3(1) / 2.0f, camera));
+			}
+
+			ImGui::Text("Octree %i (%i instances): %.2f - Max Depth: %i", i, instances, d, Utils::GetLOD(d, octree.m_Nodes[0].top_corner.max(), octree.m_MaxDepth));
+
+			if (octree.m_Layout == OctreeLayout::Standard && ImGui::Button("Compact Layout"))
+				octree.set_layout(OctreeLayout::Compact);
+
+			if ((octree.m_Layout == OctreeLayout::Standard || octree.m_Layout == OctreeLayout::Compact) && ImGui::Button("DAG Layout"))
+				octree.set_layout(OctreeLayout::DAG);
+
+			if (octree.m_Layout == OctreeLayout::Standard && ImGui::Button("Brickmap Layout"))
+				octree.set_layout(OctreeLayout::Brickmap);
+
+			if (octree.m_Layout == OctreeLayout::Standard && !octree.has_ropes() && ImGui::Button("Build Ropes"))
+				octree.build_ropes();
+
+			if (octree.m_Layout == OctreeLayout::Standard && ImGui::Button("Tree64 Benchmark"))
+				m_Renderer.BenchmarkTree64(octree);
+
+			bool parametric = octree.m_Traversal == OctreeTraversal::Parametric;
+			if (ImGui::Checkbox("Parametric Traversal", &parametric))
+				octree.m_Traversal = parametric ? OctreeTraversal::Parametric : OctreeTraversal::DDA;
+
+			if (ImGui::TreeNode("Materials"))
+			{
+				bool changed = false;
+				for (int m = 1; m < octree.m_Materials.size(); m++)
+				{
+					ImGui::PushID(m);
+
+					Material& material = octree.m_Materials[m];
+					ImGui::Text("Material %i", m);
+					changed |= ImGui::ColorEdit3("Color", glm::value_ptr(material.Color));
+					changed |= ImGui::DragFloat("Roughness", &material.Roughness, 0.01f, 0.0f, 1.0f);
+					changed |= ImGui::DragFloat("Emission", &material.Emission, 0.05f, 0.0f, 10.0f);
+
+					ImGui::PopID();
+				}
+
+				// Only the LOD colours are baked from the materials
+				if (changed && octree.m_Layout == OctreeLayout::Standard)
+					octree.build_lods();
+
+				ImGui::TreePop();
+			}
 
 			ImGui::Separator();
 
@@ -0,0 +1,214 @@
+#include "Brickmap.h"
+
+#include "Octree.h"
+
+#include "Walnut/Timer.h"
+
+#include "../Core.h"
+
+#include <iostream>
+
+Brickmap::Brickmap()
+	: m_Size(0), m_GridSize(0) {}
+
+void Brickmap::build(uint16_t size_x, uint16_t size_y, uint16_t size_z, const std::vector<Voxel>& voxels)
+{
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
+
+	m_Size = glm::ivec3(size_x, size_y, size_z);
+	m_GridSize = (m_Size + 7) / 8;
+
+	m_Grid.assign(m_GridSize.x * m_GridSize.y * m_GridSize.z, -1);
+	m_Bricks.clear();
+	m_MaterialIds.clear();
+
+	// Occupancy, bricks are allocated on the first voxel
+	for (const Voxel& voxel : voxels)
+	{
+		uint32_t& idx = m_Grid[brick_index(voxel.x / 8, voxel.y / 8, voxel.z / 8)];
+		if (idx == -1)
+		{
+			idx = (uint32_t) m_Bricks.size();
+			m_Bricks.emplace_back();
+		}
+
+		m_Bricks[idx].occupancy[voxel.z % 8] |= 1ull << ((voxel.y % 8) * 8 + voxel.x % 8);
+	}
+
+	// Every brick owns a run of the material pool as long as its popcount
+	uint32_t offset = 0;
+	for (Brick& brick : m_Bricks)
+	{
+		brick.material_offset = offset;
+		for (uint8_t w = 0; w < 8; w++)
+			offset += Brick::popcount(brick.occupancy[w]);
+	}
+
+	m_MaterialIds.resize(offset);
+	for (const Voxel& voxel : voxels)
+	{
+		const Brick& brick = m_Bricks[m_Grid[brick_index(voxel.x / 8, voxel.y / 8, voxel.z / 8)]];
+		m_MaterialIds[brick.material_index(voxel.x % 8, voxel.y % 8, voxel.z % 8)] = (uint16_t) voxel.data;
+	}
+
+	LOG("Build Brickmap: " << m_Bricks.size() << " bricks " << ((m_Grid.size() * sizeof(uint32_t) + m_Bricks.size() * sizeof(Brick) + m_MaterialIds.size() * sizeof(uint16_t)) / 1024.0f) << " KB in " << t.ElapsedMillis() << "ms");
+}
+
+bool Brickmap::find_voxel(uint16_t x, uint16_t y, uint16_t z, uint32_t& data) const
+{
+	if (x >= m_Size.x || y >= m_Size.y || z >= m_Size.z)
+		return false;
+
+	uint32_t idx = m_Grid[brick_index(x / 8, y / 8, z / 8)];
+	if (idx == -1)
+		return false;
+
+	const Brick& brick = m_Bricks[idx];
+	if (!brick.is_set(x % 8, y % 8, z % 8))
+		return false;
+
+	data = m_MaterialIds[brick.material_index(x % 8, y % 8, z % 8)];
+	return true;
+}
+
+bool Brickmap::ray_travel(const Ray& ray, RayHit* hit) const
+{
+	hit->Position = {};
+	hit->Node = nullptr;
+	hit->Data = 0;
+	hit->Normal = {};
+
+	if (is_empty())
+		return false;
+
+	// Clip against the volume, remember the entry face
+	float t_enter = 0, t_exit = FLT_MAX;
+	int enter_axis = -1;
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		if (ray.Direction[a] == 0)
+		{
+			if (ray.Origin[a] < 0 || ray.Origin[a] >= m_Size[a])
+				return false;
+			continue;
+		}
+
+		float t0 = -ray.Origin[a] * ray.InvDirection[a];
+		float t1 = (m_Size[a] - ray.Origin[a]) * ray.InvDirection[a];
+		if (t0 > t1)
+			std::swap(t0, t1);
+
+		if (t0 > t_enter)
+		{
+			t_enter = t0;
+			enter_axis = a;
+		}
+		t_exit = std::min(t_exit, t1);
+	}
+
+	if (t_enter >= t_exit || t_enter > ray.MaxDistance)
+		return false;
+
+	glm::vec3 norm{};
+	if (enter_axis != -1)
+		norm[enter_axis] = -glm::sign(ray.Direction[enter_axis]);
+	else
+	{
+		// Starting inside, face the major axis
+		glm::vec3 dir = glm::abs(ray.Direction);
+		uint8_t axis = dir.x >= dir.y && dir.x >= dir.z ? 0 : (dir.y >= dir.z ? 1 : 2);
+		norm[axis] = -glm::sign(ray.Direction[axis]);
+	}
+
+	// Coarse DDA over bricks
+	glm::vec3 p = ray.Origin + ray.Direction * t_enter;
+	glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor(p / 8.0f)), glm::ivec3(0), m_GridSize - 1);
+
+	glm::ivec3 step;
+	glm::vec3 t_max, t_delta;
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		step[a] = ray.Direction[a] > 0 ? 1 : (ray.Direction[a] < 0 ? -1 : 0);
+		if (step[a] == 0)
+		{
+			t_max[a] = t_delta[a] = FLT_MAX;
+			continue;
+		}
+
+		t_max[a] = ((cell[a] + (step[a] > 0)) * 8 - ray.Origin[a]) * ray.InvDirection[a];
+		t_delta[a] = 8 * step[a] * ray.InvDirection[a];
+	}
+
+	float t = t_enter;
+	t_exit = std::min(t_exit, (float) ray.MaxDistance);
+	while (true)
+	{
+		uint32_t idx = m_Grid[brick_index(cell.x, cell.y, cell.z)];
+		if (idx != -1 && brick_ray_travel(ray, m_Bricks[idx], cell, t, norm, hit))
+			return true;
+
+		uint8_t axis = t_max.x < t_max.y ? (t_max.x < t_max.z ? 0 : 2) : (t_max.y < t_max.z ? 1 : 2);
+
+		// Edge bricks overhang the volume, stop at its exit instead
+		t = t_max[axis];
+		cell[axis] += step[axis];
+		if (t > t_exit || cell[axis] < 0 || cell[axis] >= m_GridSize[axis])
+			break;
+
+		t_max[axis] += t_delta[axis];
+		norm = glm::vec3(0);
+		norm[axis] = (float) -step[axis];
+	}
+
+	return false;
+}
+
+bool Brickmap::brick_ray_travel(const Ray& ray, const Brick& brick, const glm::ivec3& brick_pos, float t, glm::vec3 norm, RayHit* hit) const
+{
+	// Fine DDA over the voxels of one brick, starting where the ray entered it
+	glm::ivec3 bottom = brick_pos * 8;
+	glm::ivec3 top = glm::min(bottom + 7, m_Size - 1);
+
+	glm::vec3 p = ray.Origin + ray.Direction * t;
+	glm::ivec3 voxel = glm::clamp(glm::ivec3(glm::floor(p)), bottom, top);
+
+	glm::ivec3 step;
+	glm::vec3 t_max, t_delta;
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		step[a] = ray.Direction[a] > 0 ? 1 : (ray.Direction[a] < 0 ? -1 : 0);
+		if (step[a] == 0)
+		{
+			t_max[a] = t_delta[a] = FLT_MAX;
+			continue;
+		}
+
+		t_max[a] = (voxel[a] + (step[a] > 0) - ray.Origin[a]) * ray.InvDirection[a];
+		t_delta[a] = step[a] * ray.InvDirection[a];
+	}
+
+	while (true)
+	{
+		glm::ivec3 local = voxel - bottom;
+		if (brick.is_set(local.x, local.y, local.z))
+		{
+			hit->Position = glm::vec3(voxel.x, voxel.y, voxel.z);
+			hit->Node = nullptr;
+			hit->Data = m_MaterialIds[brick.material_index(local.x, local.y, local.z)];
+			hit->Normal = norm;
+			return true;
+		}
+
+		uint8_t axis = t_max.x < t_max.y ? (t_max.x < t_max.z ? 0 : 2) : (t_max.y < t_max.z ? 1 : 2);
+
+		voxel[axis] += step[axis];
+		if (voxel[axis] < bottom[axis] || voxel[axis] > top[axis])
+			return false;
+
+		t_max[axis] += t_delta[axis];
+		norm = glm::vec3(0);
+		norm[axis] = (float) -step[axis];
+	}
+}
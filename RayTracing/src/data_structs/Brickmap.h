@@ -0,0 +1,73 @@
+#pragma once
+
+#include "../Ray.h"
+
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct Voxel;
+
+// 72 bytes | 576 bit
+// 8^3 occupancy bits, word z holds the bits of row (x, y) as y * 8 + x.
+// Material ids of the set bits are packed in bit order starting at material_offset.
+struct Brick
+{
+	uint64_t occupancy[8];
+	uint32_t material_offset;
+
+	Brick()
+		: occupancy(), material_offset(0) {}
+
+	bool is_set(uint8_t x, uint8_t y, uint8_t z) const
+	{
+		return (occupancy[z] >> (y * 8 + x)) & 1;
+	}
+
+	uint32_t material_index(uint8_t x, uint8_t y, uint8_t z) const
+	{
+		uint32_t rank = material_offset;
+		for (uint8_t w = 0; w < z; w++)
+			rank += popcount(occupancy[w]);
+
+		return rank + popcount(occupancy[z] & ((1ull << (y * 8 + x)) - 1));
+	}
+
+	static uint8_t popcount(uint64_t v)
+	{
+#ifdef _MSC_VER
+		return (uint8_t) __popcnt64(v);
+#else
+		return (uint8_t) __builtin_popcountll(v);
+#endif
+	}
+};
+
+// Two level grid for small dense models: a coarse grid of brick indices
+// (-1 for empty bricks) over 8^3 bit bricks, every lookup is O(1)
+class Brickmap
+{
+public:
+	Brickmap();
+
+	void build(uint16_t size_x, uint16_t size_y, uint16_t size_z, const std::vector<Voxel>& voxels);
+
+	bool find_voxel(uint16_t x, uint16_t y, uint16_t z, uint32_t& data) const;
+
+	bool ray_travel(const Ray& ray, RayHit* hit) const;
+
+	bool is_empty() const { return m_Bricks.size() == 0; }
+
+private:
+	uint32_t brick_index(int x, int y, int z) const { return x + (y + z * m_GridSize.y) * m_GridSize.x; }
+
+	bool brick_ray_travel(const Ray& ray, const Brick& brick, const glm::ivec3& brick_pos, float t, glm::vec3 norm, RayHit* hit) const;
+
+public:
+	glm::ivec3 m_Size, m_GridSize;
+	std::vector<uint32_t> m_Grid;
+	std::vector<Brick> m_Bricks;
+	std::vector<uint16_t> m_MaterialIds;
+};
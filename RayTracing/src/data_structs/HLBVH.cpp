@@ -1,209 +1,504 @@
 #include "HLBVH.h"
 
 #include "../utils/Utils.h"
+#include "../utils/ThreadPool.h"
+#include "../Core.h"
 
 #include "Walnut/Timer.h"
 
+#include <cassert>
 #include <iostream>
 
 #include <glm/ext/matrix_transform.hpp>
 
-HLBVH::HLBVH(std::vector<Octree>& primitives, int maxPrimsInNode)
-	: m_MaxPrimsInNode(std::min(255, maxPrimsInNode)), m_Primitives(primitives), m_Nodes() {}
+HLBVH::HLBVH(std::vector<Octree>& assets, std::vector<OctreeInstance>& instances, int maxPrimsInNode)
+	: m_MaxPrimsInNode(std::min(255, maxPrimsInNode)), m_Assets(assets), m_Primitives(instances), m_Nodes() {}
+
+// Spread the lowest 10 bits of x so there are two zero bits between each of them
+static uint32_t LeftShift3(uint32_t x)
+{
+	if (x == (1 << 10))
+		x--;
+
+	x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+	x = (x | (x << 8)) & 0b00000011000000001111000000001111;
+	x = (x | (x << 4)) & 0b00000011000011000011000011000011;
+	x = (x | (x << 2)) & 0b00001001001001001001001001001001;
+	return x;
+}
+
+// 30 bit Morton code of a point in [0, 1024)^3
+static uint32_t EncodeMorton3(const glm::vec3& v)
+{
+	return (LeftShift3((uint32_t) v.z) << 2) | (LeftShift3((uint32_t) v.y) << 1) | LeftShift3((uint32_t) v.x);
+}
+
+// Distance to where the ray enters the voxel at pos, rays that only graze it count as well
+static float VoxelEntry(const glm::vec3& pos, const Ray& ray)
+{
+	glm::vec3 t1 = (pos - ray.Origin) * ray.InvDirection;
+	glm::vec3 t2 = (pos + glm::vec3(1) - ray.Origin) * ray.InvDirection;
+	glm::vec3 tmin = glm::min(t1, t2);
+
+	return std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.0f));
+}
 
 void HLBVH::Build()
 {
 	if (m_Primitives.size() == 0)
+	{
+		// Drop the tree of the previous scene, Intersect and Refit then see an empty BVH
+		m_Nodes.clear();
+		m_PrimitiveIndices.clear();
+		m_BuildCost = 0;
 		return;
+	}
 
 	Walnut::Timer t;
+	ThreadPool& pool = ThreadPool::Get();
+
+	uint32_t nPrimitives = (uint32_t) m_Primitives.size();
+	const uint32_t batch_size = 4096;
+	const uint32_t batches = (nPrimitives + batch_size - 1) / batch_size;
+
+	// Initialize _primitiveInfo_ array for primitives, every batch also bounds its centroids
+	std::vector<BVHPrimitiveInfo> primitiveInfo(nPrimitives);
+	std::vector<glm::vec3> batchBounds(2 * batches);
+	pool.ParallelFor(batches, [&](uint32_t batch) {
+		glm::vec3 batch_min(FLT_MAX), batch_max(-FLT_MAX);
+		uint32_t end = std::min((batch + 1) * batch_size, nPrimitives);
+		for (uint32_t i = batch * batch_size; i < end; i++)
+		{
+			primitiveInfo[i].instance_index = i;
+			instanceBounds(m_Primitives[i], primitiveInfo[i].bottom_corner, primitiveInfo[i].top_corner);
+			primitiveInfo[i].centroid = (primitiveInfo[i].bottom_corner + primitiveInfo[i].top_corner) * 0.5f;
+			Utils::UnionAABBs(batch_min, batch_max, primitiveInfo[i].centroid);
+		}
 
-	// Initialize _primitiveInfo_ array for primitives
-	std::vector<BVHPrimitiveInfo> primitiveInfo(m_Primitives.size());
-	for (uint32_t i = 0; i < m_Primitives.size(); i++)
-	{
-		primitiveInfo[i] = { i, m_Primitives[i].m_Nodes[0].bottom_corner + m_Primitives[i].m_Position,
-								m_Primitives[i].m_Nodes[0].top_corner    + m_Primitives[i].m_Position };
+		batchBounds[2 * batch] = batch_min;
+		batchBounds[2 * batch + 1] = batch_max;
+	});
+
+	// Compute bounding box of primitive centroids
+	glm::vec3 centroid_min = batchBounds[0], centroid_max = batchBounds[1];
+	for (uint32_t i = 1; i < batches; i++)
+		Utils::UnionAABBs(centroid_min, centroid_max, batchBounds[2 * i], batchBounds[2 * i + 1]);
+
+	glm::vec3 extent = centroid_max - centroid_min;
+	for (uint8_t i = 0; i < 3; i++)
+		if (extent[i] <= 0)
+			extent[i] = 1;
+
+	// Compute Morton indices of primitives
+	const uint32_t mortonScale = 1 << 10;
+	std::vector<std::pair<uint64_t, uint32_t>> mortonPrims(nPrimitives);
+	pool.ParallelFor(batches, [&](uint32_t batch) {
+		uint32_t end = std::min((batch + 1) * batch_size, nPrimitives);
+		for (uint32_t i = batch * batch_size; i < end; i++)
+		{
+			glm::vec3 offset = (primitiveInfo[i].centroid - centroid_min) / extent;
+			mortonPrims[i] = { EncodeMorton3(offset * (float) mortonScale), i };
+		}
+	});
 
-		primitiveInfo[i].centroid = { (primitiveInfo[i].bottom_corner.x + primitiveInfo[i].top_corner.x) / 2,
-									  (primitiveInfo[i].bottom_corner.y + primitiveInfo[i].top_corner.y) / 2,
-									  (primitiveInfo[i].bottom_corner.z + primitiveInfo[i].top_corner.z) / 2 };
+	Utils::RadixSort(mortonPrims, 30);
+
+	// Find intervals of primitives for each treelet, the upper 12 bits split the scene in 4096 cells
+	const uint32_t mask = 0b00111111111111000000000000000000;
+	std::vector<LBVHTreelet> treeletsToBuild;
+	uint32_t nodesNeeded = 0;
+	for (uint32_t start = 0, end = 1; end <= nPrimitives; end++)
+	{
+		if (end == nPrimitives || ((mortonPrims[start].first & mask) != (mortonPrims[end].first & mask)))
+		{
+			treeletsToBuild.push_back({ start, end - start, nullptr });
+			nodesNeeded += 2 * (end - start) - 1;
+			start = end;
+		}
 	}
 
-	// Recursively build BVH tree for primitives
-	int totalNodes = 0;
-	std::vector<Octree> orderedPrims;
-	orderedPrims.reserve(m_Primitives.size());
+	// Every node is carved from one arena, the upper SAH needs 2 * treelets - 1 at most.
+	// It is freed on return, Intersect and Refit only use the flattened m_Nodes
+	uint32_t upperNodes = nodesNeeded;
+	nodesNeeded += 2 * (uint32_t) treeletsToBuild.size() - 1;
+	std::vector<BVHBuildNode> buildNodes(nodesNeeded);
 
-	BVHBuildNode* root = build(primitiveInfo, 0, primitiveInfo.size(), &totalNodes, orderedPrims);
+	nodesNeeded = 0;
+	for (LBVHTreelet& treelet : treeletsToBuild)
+	{
+		treelet.buildNodes = &buildNodes[nodesNeeded];
+		nodesNeeded += 2 * treelet.nPrimitives - 1;
+	}
 
-	m_Primitives = move(orderedPrims);
+	// Create LBVHs for treelets in parallel
+	std::atomic<int> atomicTotal(0);
+	std::atomic<uint32_t> orderedPrimsOffset(0);
+	std::vector<uint32_t> orderedPrims(nPrimitives);
+	std::vector<BVHPrimitiveInfo> treeletInfo(treeletsToBuild.size());
+	pool.ParallelFor((uint32_t) treeletsToBuild.size(), [&](uint32_t i) {
+		// Generate i-th LBVH treelet
+		int nodesCreated = 0;
+		const int firstBitIndex = 29 - 12;
+		LBVHTreelet& tr = treeletsToBuild[i];
+		BVHBuildNode* nodes = tr.buildNodes;
+		tr.buildNodes = emitLBVH(nodes, primitiveInfo, &mortonPrims[tr.startIndex], tr.nPrimitives,
+			&nodesCreated, orderedPrims, &orderedPrimsOffset, firstBitIndex);
+		atomicTotal += nodesCreated;
+
+		treeletInfo[i].instance_index = i;
+		treeletInfo[i].bottom_corner = tr.buildNodes->bottom_corner;
+		treeletInfo[i].top_corner = tr.buildNodes->top_corner;
+		treeletInfo[i].centroid = (tr.buildNodes->bottom_corner + tr.buildNodes->top_corner) * 0.5f;
+	});
+
+	// Create SAH BVH from LBVH treelets, a full binary tree over the treelet roots
+	BVHBuildNode* root = buildUpperSAH(&buildNodes[upperNodes], treeletInfo, treeletsToBuild, 0, (uint32_t) treeletsToBuild.size(), 0);
+	int totalNodes = atomicTotal + (int) treeletsToBuild.size() - 1;
+
+	// The instances keep their order, leaves reference them through m_PrimitiveIndices
+	m_PrimitiveIndices = std::move(orderedPrims);
 	std::cout << "BVH created with " << totalNodes << " nodes for " << (int)m_Primitives.size() << " primitives (" << float(totalNodes * sizeof(LinearBVHNode)) / (1024.f * 1024.f) << " MB) in " << t.ElapsedMillis() << "ms" << std::endl;
 
 	m_Nodes = std::vector<LinearBVHNode>(totalNodes);
 
 	uint32_t offset = 0;
 	flattenBVHTree(root, &offset);
+
+	m_BuildCost = sahCost();
 }
 
-bool HLBVH::Intersect(const Ray& ray, RayHit* hit) const
+bool HLBVH::Refit()
 {
-	if (m_Nodes.size() <= 0 || Octree::ray_intersect_box(m_Nodes[0].bound_min, m_Nodes[0].bound_max, ray) == -1)
+	if (m_Nodes.size() == 0)
+	{
+		Build();
+		return true;
+	}
+
+#ifdef RAY_FULL_TRACE
+	Walnut::Timer t;
+#endif // RAY_FULL_TRACE
+
+	// Split the tree in contiguous subtrees, the nodes above them are kept in depth-first order
+	const uint32_t subtreeNodes = 4096;
+	std::vector<uint32_t> upperNodes;
+	std::vector<std::pair<uint32_t, uint32_t>> subtrees;
+	std::vector<std::pair<uint32_t, uint32_t>> stack = { { 0, (uint32_t) m_Nodes.size() } };
+	while (!stack.empty())
+	{
+		auto [start, end] = stack.back();
+		stack.pop_back();
+
+		if (end - start <= subtreeNodes || m_Nodes[start].nPrimitives > 0)
+		{
+			subtrees.emplace_back(start, end);
+			continue;
+		}
+
+		upperNodes.push_back(start);
+		stack.emplace_back(m_Nodes[start].secondChildOffset, end);
+		stack.emplace_back(m_Nodes[start].firstChildOffset, m_Nodes[start].secondChildOffset);
+	}
+
+	std::vector<float> costs(subtrees.size());
+	ThreadPool::Get().ParallelFor((uint32_t) subtrees.size(), [&](uint32_t i) {
+		costs[i] = refitRange(subtrees[i].first, subtrees[i].second);
+	});
+
+	float cost = 0;
+	for (float subtreeCost : costs)
+		cost += subtreeCost;
+
+	// Parents were visited before their childs
+	for (auto it = upperNodes.rbegin(); it != upperNodes.rend(); it++)
+		cost += refitNode(m_Nodes[*it]);
+
+	cost /= Utils::SurfaceArea(m_Nodes[0].bound_min, m_Nodes[0].bound_max + glm::vec3(1));
+
+	FULL_TRACE("BVH refitted in " << t.ElapsedMillis() << "ms, SAH cost " << cost << " (built " << m_BuildCost << ")");
+
+	if (cost <= m_BuildCost * REFIT_MAX_COST_RATIO)
 		return false;
 
-	return findPossibleHits(ray, &m_Nodes[0], hit);
+	Build();
+	return true;
 }
 
-BVHBuildNode* HLBVH::build(std::vector<BVHPrimitiveInfo>& primitiveInfo, uint32_t start, uint32_t end, int* totalNodes, std::vector<Octree>& orderedPrims)
+bool HLBVH::Intersect(const Ray& ray, RayHit* hit) const
 {
-	(*totalNodes)++;
-	
-	BVHBuildNode* node = new BVHBuildNode();
+	if (m_Nodes.size() <= 0)
+		return false;
 
-	// Compute bounds of all primitives in BVH node
-	glm::vec3 bounds_min = primitiveInfo[start].bottom_corner, bounds_max = primitiveInfo[start].top_corner;
-	for (uint32_t i = start + 1; i < end; i++)
-		Utils::UnionAABBs(bounds_min, bounds_max, primitiveInfo[i].bottom_corner, primitiveInfo[i].top_corner);
+	hit->Distance = FLT_MAX;
+	bool dirIsNeg[3] = { ray.InvDirection.x < 0, ray.InvDirection.y < 0, ray.InvDirection.z < 0 };
 
-	uint32_t nPrimitives = end - start;
-	if (nPrimitives == 1)
+	// Follow ray through BVH nodes to find primitive intersections
+	uint32_t toVisitOffset = 0, currentNodeIndex = 0;
+	uint32_t nodesToVisit[TRAVERSAL_STACK_SIZE];
+	bool found = false;
+	while (true)
 	{
-		// Create leaf _BVHBuildNode_
-		uint32_t firstPrimOffset = orderedPrims.size();
-		for (uint32_t i = start; i < end; i++) {
-			orderedPrims.push_back(m_Primitives[primitiveInfo[i].octree_index]);
+		// Nodes entered past the closest hit so far can't hold a nearer one
+		const LinearBVHNode* node = &m_Nodes[currentNodeIndex];
+		float d = Octree::ray_intersect_box(node->bound_min, node->bound_max, ray);
+		if (d != -1 && d < hit->Distance)
+		{
+			if (node->nPrimitives > 0)
+			{
+				found |= intersectLeaf(ray, node, hit);
+				if (toVisitOffset == 0)
+					break;
+
+				currentNodeIndex = nodesToVisit[--toVisitOffset];
+			}
+			else
+			{
+				// The first child is below the split, put the far one on the stack and advance to the near one
+				assert(toVisitOffset < TRAVERSAL_STACK_SIZE);
+				if (dirIsNeg[node->axis])
+				{
+					nodesToVisit[toVisitOffset++] = node->firstChildOffset;
+					currentNodeIndex = node->secondChildOffset;
+				}
+				else
+				{
+					nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+					currentNodeIndex = node->firstChildOffset;
+				}
+			}
+		}
+		else
+		{
+			if (toVisitOffset == 0)
+				break;
+
+			currentNodeIndex = nodesToVisit[--toVisitOffset];
 		}
-		
-		node->InitLeaf(firstPrimOffset, nPrimitives, bounds_min, bounds_max);
-		return node;
 	}
 
-	// Compute bound of primitive centroids, choose split dimension _dim_
-	glm::vec3 centroid_min, centroid_max;
-	centroid_min = centroid_max = primitiveInfo[start].centroid;
+	return found;
+}
 
-	for (uint32_t i = start + 1; i < end; i++)
-		Utils::UnionAABBs(centroid_min, centroid_max, primitiveInfo[i].centroid);
-	int dim = Utils::MaxExtension(centroid_min, centroid_max);
-	
-	// Partition primitives into two sets and build children
-	uint32_t mid = (start + end) / 2;
-	if (centroid_max[dim] == centroid_min[dim])
+BVHBuildNode* HLBVH::emitLBVH(BVHBuildNode*& buildNodes, const std::vector<BVHPrimitiveInfo>& primitiveInfo, const std::pair<uint64_t, uint32_t>* mortonPrims,
+	uint32_t nPrimitives, int* totalNodes, std::vector<uint32_t>& orderedPrims, std::atomic<uint32_t>* orderedPrimsOffset, int bitIndex)
+{
+	if (nPrimitives <= (uint32_t) m_MaxPrimsInNode)
 	{
-		// Create leaf _BVHBuildNode_
-		uint32_t firstPrimOffset = orderedPrims.size();
-		for (uint32_t i = start; i < end; i++) 
-			orderedPrims.push_back(m_Primitives[primitiveInfo[i].octree_index]);
+		// Create and return leaf node of LBVH treelet
+		(*totalNodes)++;
+		BVHBuildNode* node = buildNodes++;
+
+		uint32_t firstPrimOffset = orderedPrimsOffset->fetch_add(nPrimitives);
+		glm::vec3 bounds_min = primitiveInfo[mortonPrims[0].second].bottom_corner, bounds_max = primitiveInfo[mortonPrims[0].second].top_corner;
+		for (uint32_t i = 0; i < nPrimitives; i++)
+		{
+			uint32_t primitiveIndex = mortonPrims[i].second;
+			orderedPrims[firstPrimOffset + i] = primitiveIndex;
+			Utils::UnionAABBs(bounds_min, bounds_max, primitiveInfo[primitiveIndex].bottom_corner, primitiveInfo[primitiveIndex].top_corner);
+		}
 
 		node->InitLeaf(firstPrimOffset, nPrimitives, bounds_min, bounds_max);
 		return node;
 	}
 
-	// Partition primitives using approximate SAH
-	if (nPrimitives <= m_MaxPrimsInNode)
+	uint32_t splitOffset = nPrimitives / 2;
+	if (bitIndex >= 0)
 	{
-		// Partition primitives into equally-sized subsets
-		mid = (start + end) / 2;
-		std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
-			&primitiveInfo[end - 1] + 1, ComparePoints(dim));
-
-		node->InitInterior(dim,
-			build(primitiveInfo, start, mid,
-				totalNodes, orderedPrims),
-			build(primitiveInfo, mid, end,
-				totalNodes, orderedPrims));
-
-		return node;
+		// Advance to next subtree level if there's no LBVH split for this bit
+		uint32_t mask = 1 << bitIndex;
+		if ((mortonPrims[0].first & mask) == (mortonPrims[nPrimitives - 1].first & mask))
+			return emitLBVH(buildNodes, primitiveInfo, mortonPrims, nPrimitives, totalNodes, orderedPrims, orderedPrimsOffset, bitIndex - 1);
+
+		// Find LBVH split point for this dimension
+		uint32_t searchStart = 0, searchEnd = nPrimitives - 1;
+		while (searchStart + 1 != searchEnd)
+		{
+			uint32_t mid = (searchStart + searchEnd) / 2;
+			if ((mortonPrims[searchStart].first & mask) == (mortonPrims[mid].first & mask))
+				searchStart = mid;
+			else
+				searchEnd = mid;
+		}
+		splitOffset = searchEnd;
 	}
+	// Equal codes past the last bit are split in half, leaves must stay within m_MaxPrimsInNode
 
-	// Allocate _BucketInfo_ for SAH partition buckets
-	const int nBuckets = 12;
-	struct BucketInfo {
-		BucketInfo()
-			: bounds_min(0), bounds_max(0), count(0) {}
-
-		int count;
-		glm::vec3 bounds_min, bounds_max;
+	// Create and return interior LBVH node
+	(*totalNodes)++;
+	BVHBuildNode* node = buildNodes++;
+	BVHBuildNode* lbvh[2] = {
+		emitLBVH(buildNodes, primitiveInfo, mortonPrims, splitOffset, totalNodes, orderedPrims, orderedPrimsOffset, std::max(bitIndex - 1, -1)),
+		emitLBVH(buildNodes, primitiveInfo, &mortonPrims[splitOffset], nPrimitives - splitOffset, totalNodes, orderedPrims, orderedPrimsOffset, std::max(bitIndex - 1, -1))
 	};
-	BucketInfo buckets[nBuckets];
 
-	// Initialize _BucketInfo_ for SAH partition buckets
-	for (uint32_t i = start; i < end; ++i)
-	{
-		int b = nBuckets *
-			((primitiveInfo[i].centroid[dim] - centroid_min[dim]) /
-				(centroid_max[dim] - centroid_min[dim]));
+	uint32_t axis = bitIndex >= 0 ? bitIndex % 3 : 0;
+	node->InitInterior(axis, lbvh[0], lbvh[1]);
+	return node;
+}
+
+BVHBuildNode* HLBVH::buildUpperSAH(BVHBuildNode* buildNodes, std::vector<BVHPrimitiveInfo>& treeletInfo, const std::vector<LBVHTreelet>& treelets, uint32_t start, uint32_t end, uint32_t depth)
+{
+	uint32_t nNodes = end - start;
+	if (nNodes == 1)
+		return treelets[treeletInfo[start].instance_index].buildNodes;
 
-		if (b == nBuckets)
-			b = nBuckets - 1;
+	BVHBuildNode* node = buildNodes;
 
-		buckets[b].count++;
-		Utils::UnionAABBs(buckets[b].bounds_min, buckets[b].bounds_max, primitiveInfo[i].bottom_corner, primitiveInfo[i].top_corner);
+	// Compute bounds of all nodes under this HLBVH node
+	glm::vec3 bounds_min = treeletInfo[start].bottom_corner, bounds_max = treeletInfo[start].top_corner;
+	glm::vec3 centroid_min = treeletInfo[start].centroid, centroid_max = treeletInfo[start].centroid;
+	for (uint32_t i = start + 1; i < end; i++)
+	{
+		Utils::UnionAABBs(bounds_min, bounds_max, treeletInfo[i].bottom_corner, treeletInfo[i].top_corner);
+		Utils::UnionAABBs(centroid_min, centroid_max, treeletInfo[i].centroid);
 	}
+	int dim = Utils::MaxExtension(centroid_min, centroid_max);
 
-	// Compute costs for splitting after each bucket
-	float cost[nBuckets - 1];
-	for (int i = 0; i < nBuckets - 1; ++i)
+	// Past UPPER_SAH_MAX_DEPTH the median split bounds the depth, the traversal stack has a fixed size
+	uint32_t mid = (start + end) / 2;
+	if (depth >= UPPER_SAH_MAX_DEPTH)
+		std::nth_element(&treeletInfo[start], &treeletInfo[mid], &treeletInfo[end - 1] + 1,
+			[dim](const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) { return a.centroid[dim] < b.centroid[dim]; });
+	else if (centroid_max[dim] != centroid_min[dim])
 	{
-		glm::vec3 min0, max0, min1, max1;
-		int count0 = 0, count1 = 0;
-		for (int j = 0; j <= i; ++j)
+		// Allocate _BucketInfo_ for SAH partition buckets
+		const int nBuckets = 12;
+		struct BucketInfo
 		{
-			Utils::UnionAABBs(min0, max0, buckets[j].bounds_min, buckets[j].bounds_max);
-			count0 += buckets[j].count;
+			int count = 0;
+			glm::vec3 bounds_min = glm::vec3(FLT_MAX), bounds_max = glm::vec3(-FLT_MAX);
+		};
+		BucketInfo buckets[nBuckets];
+
+		const float offset = centroid_min[dim];
+		const float scale = nBuckets / (centroid_max[dim] - centroid_min[dim]);
+		auto bucketOf = [&](const BVHPrimitiveInfo& p) {
+			return std::min((int) ((p.centroid[dim] - offset) * scale), nBuckets - 1);
+		};
+
+		// Initialize _BucketInfo_ for HLBVH SAH partition buckets
+		for (uint32_t i = start; i < end; i++)
+		{
+			BucketInfo& bucket = buckets[bucketOf(treeletInfo[i])];
+			bucket.count++;
+			Utils::UnionAABBs(bucket.bounds_min, bucket.bounds_max, treeletInfo[i].bottom_corner, treeletInfo[i].top_corner);
 		}
 
-		for (int j = i + 1; j < nBuckets; ++j)
+		// Sweep from the right for the area below every split, then from the left for the cost
+		float areaAbove[nBuckets - 1];
+		glm::vec3 sweep_min(FLT_MAX), sweep_max(-FLT_MAX);
+		int countAbove = 0;
+		for (int i = nBuckets - 1; i > 0; i--)
 		{
-			Utils::UnionAABBs(min1, max1, buckets[j].bounds_min, buckets[j].bounds_max);
-			count1 += buckets[j].count;
+			Utils::UnionAABBs(sweep_min, sweep_max, buckets[i].bounds_min, buckets[i].bounds_max);
+			countAbove += buckets[i].count;
+			areaAbove[i - 1] = countAbove ? countAbove * Utils::SurfaceArea(sweep_min, sweep_max) : 0;
 		}
 
-		cost[i] = .125f + (count0 * Utils::SurfaceArea(min0, max0) + count1 * Utils::SurfaceArea(min1, max1)) /
-			Utils::SurfaceArea(bounds_min, bounds_max);
-	}
-
-	// Find bucket to split at that minimizes SAH metric
-	float minCost = cost[0];
-	uint32_t minCostSplit = 0;
-	for (int i = 1; i < nBuckets - 1; ++i)
-	{
-		if (cost[i] < minCost)
+		// Find bucket to split at that minimizes SAH metric, the constant terms don't change the choice
+		int minCostSplitBucket = 0;
+		float minCost = FLT_MAX;
+		sweep_min = glm::vec3(FLT_MAX);
+		sweep_max = glm::vec3(-FLT_MAX);
+		int countBelow = 0;
+		for (int i = 0; i < nBuckets - 1; i++)
 		{
-			minCost = cost[i];
-			minCostSplit = i;
+			Utils::UnionAABBs(sweep_min, sweep_max, buckets[i].bounds_min, buckets[i].bounds_max);
+			countBelow += buckets[i].count;
+
+			float cost = (countBelow ? countBelow * Utils::SurfaceArea(sweep_min, sweep_max) : 0) + areaAbove[i];
+			if (cost < minCost)
+			{
+				minCost = cost;
+				minCostSplitBucket = i;
+			}
 		}
+
+		// Split nodes and create interior HLBVH SAH node
+		BVHPrimitiveInfo* pmid = std::partition(&treeletInfo[start], &treeletInfo[end - 1] + 1,
+			[&](const BVHPrimitiveInfo& p) { return bucketOf(p) <= minCostSplitBucket; });
+		mid = (uint32_t) (pmid - &treeletInfo[0]);
+
+		if (mid == start || mid == end)
+			mid = (start + end) / 2;
 	}
 
-	// Either create leaf or split primitives at selected SAH bucket
-	if (nPrimitives > m_MaxPrimsInNode ||
-		minCost < nPrimitives)
+	// The childs get disjoint slices of the 2 * nNodes - 1 nodes owned by this one
+	BVHBuildNode* childNodes[2] = { buildNodes + 1, buildNodes + 2 * (mid - start) };
+	uint32_t childRanges[3] = { start, mid, end };
+	BVHBuildNode* childs[2];
+
+	const uint32_t parallelNodes = 256;
+	if (nNodes >= parallelNodes)
 	{
-		BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start],
-			&primitiveInfo[end - 1] + 1,
-			CompareToBucket(minCostSplit, nBuckets, dim, centroid_min, centroid_max));
-		mid = pmid - &primitiveInfo[0];
+		ThreadPool::Get().ParallelFor(2, [&](uint32_t i) {
+			childs[i] = buildUpperSAH(childNodes[i], treeletInfo, treelets, childRanges[i], childRanges[i + 1], depth + 1);
+		});
 	}
 	else
 	{
-		// Create leaf _BVHBuildNode_
-		uint32_t firstPrimOffset = orderedPrims.size();
-		for (uint32_t i = start; i < end; ++i) {
-			uint32_t primNum = primitiveInfo[i].octree_index;
-			orderedPrims.push_back(m_Primitives[primNum]);
-		}
-		node->InitLeaf(firstPrimOffset, nPrimitives, bounds_min, bounds_max);
+		for (uint32_t i = 0; i < 2; i++)
+			childs[i] = buildUpperSAH(childNodes[i], treeletInfo, treelets, childRanges[i], childRanges[i + 1], depth + 1);
 	}
-	
-	node->InitInterior(dim,
-		build(primitiveInfo, start, mid,
-		totalNodes, orderedPrims),
-		build(primitiveInfo, mid, end,
-		totalNodes, orderedPrims));
 
+	node->InitInterior(dim, childs[0], childs[1]);
 	return node;
 }
 
+void HLBVH::instanceBounds(const OctreeInstance& instance, glm::vec3& bounds_min, glm::vec3& bounds_max) const
+{
+	const OctreeNode& root = m_Assets[instance.asset].m_Nodes[0];
+	glm::vec3 bottom = { root.bottom_corner.x, root.bottom_corner.y, root.bottom_corner.z };
+	glm::vec3 top = { root.top_corner.x, root.top_corner.y, root.top_corner.z };
+
+	Utils::TransformAABB(instance.transform, bottom, top, bounds_min, bounds_max);
+}
+
+float HLBVH::refitRange(uint32_t start, uint32_t end)
+{
+	float cost = 0;
+	for (uint32_t i = end; i-- > start;)
+		cost += refitNode(m_Nodes[i]);
+
+	return cost;
+}
+
+float HLBVH::refitNode(LinearBVHNode& node)
+{
+	if (node.nPrimitives > 0)
+	{
+		instanceBounds(m_Primitives[m_PrimitiveIndices[node.primitivesOffset]], node.bound_min, node.bound_max);
+		for (uint32_t i = 1; i < node.nPrimitives; i++)
+		{
+			glm::vec3 bounds_min, bounds_max;
+			instanceBounds(m_Primitives[m_PrimitiveIndices[node.primitivesOffset + i]], bounds_min, bounds_max);
+			Utils::UnionAABBs(node.bound_min, node.bound_max, bounds_min, bounds_max);
+		}
+
+		return node.nPrimitives * Utils::SurfaceArea(node.bound_min, node.bound_max + glm::vec3(1));
+	}
+
+	const LinearBVHNode& first = m_Nodes[node.firstChildOffset];
+	const LinearBVHNode& second = m_Nodes[node.secondChildOffset];
+	node.bound_min = first.bound_min;
+	node.bound_max = first.bound_max;
+	Utils::UnionAABBs(node.bound_min, node.bound_max, second.bound_min, second.bound_max);
+
+	return .125f * Utils::SurfaceArea(node.bound_min, node.bound_max + glm::vec3(1));
+}
+
+float HLBVH::sahCost() const
+{
+	float cost = 0;
+	for (const LinearBVHNode& node : m_Nodes)
+	{
+		float area = Utils::SurfaceArea(node.bound_min, node.bound_max + glm::vec3(1));
+		cost += node.nPrimitives > 0 ? node.nPrimitives * area : .125f * area;
+	}
+
+	return cost / Utils::SurfaceArea(m_Nodes[0].bound_min, m_Nodes[0].bound_max + glm::vec3(1));
+}
+
 uint32_t HLBVH::flattenBVHTree(BVHBuildNode* node, uint32_t* offset)
 {
 	LinearBVHNode* linearNode = &m_Nodes[*offset];
@@ -225,44 +520,41 @@ uint32_t HLBVH::flattenBVHTree(BVHBuildNode* node, uint32_t* offset)
 		linearNode->secondChildOffset = flattenBVHTree(node->childs[1], offset);
 	}
 
-	delete node;
 	return myOffset;
 }
 
-bool HLBVH::findPossibleHits(const Ray& ray, const LinearBVHNode* node, RayHit* hit) const
+bool HLBVH::intersectLeaf(const Ray& ray, const LinearBVHNode* node, RayHit* hit) const
 {
-	// Process BVH node _node_ for traversal
-	if (node->nPrimitives > 0)
-	{
-		Octree* octree = &m_Primitives[node->primitivesOffset];
-
-		Ray localRay = ray;
-		localRay.Origin -= octree->m_Position;
-
-		return octree->ray_travel(localRay, hit);
-	}
-
-	float d0 = Octree::ray_intersect_box(m_Nodes[node->firstChildOffset].bound_min, m_Nodes[node->firstChildOffset].bound_max, ray);
-	float d1 = Octree::ray_intersect_box(m_Nodes[node->secondChildOffset].bound_min, m_Nodes[node->secondChildOffset].bound_max, ray);
-	if (d0 != -1 && d1 != -1)
+	bool found = false;
+	for (uint32_t i = 0; i < node->nPrimitives; i++)
 	{
-		if (d0 < d1)
-		{
-			if (findPossibleHits(ray, &m_Nodes[node->firstChildOffset], hit))
-				return true;
-
-			return findPossibleHits(ray, &m_Nodes[node->secondChildOffset], hit);
-		}
-
-		if (findPossibleHits(ray, &m_Nodes[node->secondChildOffset], hit))
-			return true;
-
-		return findPossibleHits(ray, &m_Nodes[node->firstChildOffset], hit);
+		const OctreeInstance& instance = m_Primitives[m_PrimitiveIndices[node->primitivesOffset + i]];
+
+		// Octree traversals step in voxels, keep the local direction normalized and rescale the distance
+		glm::vec3 direction = glm::mat3(instance.inv_transform) * ray.Direction;
+		float scale = glm::length(direction);
+
+		Ray localRay;
+		localRay.Origin = glm::vec3(instance.inv_transform * glm::vec4(ray.Origin, 1.0f));
+		localRay.Direction = direction / scale;
+		localRay.InvDirection = glm::vec3(1) / localRay.Direction;
+		localRay.MaxDistance = ray.MaxDistance * scale;
+
+		RayHit instanceHit;
+		if (!m_Assets[instance.asset].ray_travel(localRay, &instanceHit))
+			continue;
+
+		// Overlapping instances keep the nearest surface, measured where the ray enters the hit voxel
+		float distance = VoxelEntry(instanceHit.Position, localRay) / scale;
+		if (distance >= hit->Distance)
+			continue;
+
+		*hit = instanceHit;
+		hit->Position = glm::vec3(instance.transform * glm::vec4(instanceHit.Position, 1.0f));
+		hit->Normal = glm::normalize(glm::transpose(glm::mat3(instance.inv_transform)) * instanceHit.Normal);
+		hit->Distance = distance;
+		found = true;
 	}
-	else if(d0 != -1)
-		return findPossibleHits(ray, &m_Nodes[node->firstChildOffset], hit);
-	else if(d1 != -1)
-		return findPossibleHits(ray, &m_Nodes[node->secondChildOffset], hit);
 
-	return false;
+	return found;
 }
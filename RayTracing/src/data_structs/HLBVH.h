@@ -2,37 +2,30 @@
 
 #include "Octree.h"
 
-struct BVHPrimitiveInfo
-{
-	uint32_t octree_index;
-	glm::vec3 bottom_corner, top_corner, centroid;
-};
+#include <atomic>
 
-struct CompareToMid
+// One placement of a shared octree asset, the assets are never copied by the BVH
+struct OctreeInstance
 {
-	CompareToMid(int d, float m)
-		: dim(d), mid(m) {}
+	OctreeInstance(uint32_t asset, const glm::mat4& transform)
+		: asset(asset) { set_transform(transform); }
 
-	bool operator()(const BVHPrimitiveInfo& a) const
+	void set_transform(const glm::mat4& t)
 	{
-		return a.centroid[dim] < mid;
+		transform = t;
+		inv_transform = glm::inverse(t);
 	}
 
-	int dim;
-	float mid;
+	uint32_t asset;
+
+	// Affine object to world, the inverse moves rays into the octree space
+	glm::mat4 transform, inv_transform;
 };
 
-struct ComparePoints
+struct BVHPrimitiveInfo
 {
-	ComparePoints(int d)
-		: dim(d) {}
-
-	bool operator()(const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) const
-	{
-		return a.centroid[dim] < b.centroid[dim];
-	}
-
-	int dim;
+	uint32_t instance_index;
+	glm::vec3 bottom_corner, top_corner, centroid;
 };
 
 struct BVHBuildNode
@@ -76,23 +69,11 @@ struct BVHBuildNode
 	uint8_t splitAxis;
 };
 
-struct CompareToBucket {
-	CompareToBucket(int split, int num, int d, const glm::vec3& min, const glm::vec3& max)
-		: min(min), max(max), splitBucket(split), nBuckets(num), dim(d) {}
-
-	bool operator()(const BVHPrimitiveInfo& p) const
-	{
-		int b = nBuckets * ((p.centroid[dim] - min[dim]) /
-			(max[dim] - min[dim]));
-
-		if (b == nBuckets)
-			b = nBuckets - 1;
-
-		return b <= splitBucket;
-	}
-	
-	int splitBucket, nBuckets, dim;
-	const glm::vec3& min, max;
+// Instances whose Morton codes share the top bits, built as one LBVH
+struct LBVHTreelet
+{
+	uint32_t startIndex, nPrimitives;
+	BVHBuildNode* buildNodes;
 };
 
 struct LinearBVHNode
@@ -110,23 +91,61 @@ struct LinearBVHNode
 class HLBVH
 {
 public:
-	HLBVH(std::vector<Octree>& primitives, int maxPrimsInNode);
+	static constexpr float REFIT_MAX_COST_RATIO = 1.5f;
 
+	// Far childs waiting in Intersect, one per level. Upper levels are at most UPPER_SAH_MAX_DEPTH + 12 deep,
+	// treelets split on 18 Morton bits and then halve equal codes, at most 32 times for 2^32 instances
+	static constexpr uint32_t TRAVERSAL_STACK_SIZE = 80;
+	static constexpr uint32_t UPPER_SAH_MAX_DEPTH = 16;
+
+	HLBVH(std::vector<Octree>& assets, std::vector<OctreeInstance>& instances, int maxPrimsInNode);
+
+	// Instances keep their index, Build and Refit never reorder them
 	void Build();
 
+	// Updates the node bounds after instances moved, instances can't be added or removed.
+	// Rebuilds instead once the SAH cost grew past REFIT_MAX_COST_RATIO of the last build, returns true then
+	bool Refit();
+
+	// Nearest hit over all instances, hit->Distance is the world distance to it along the ray
 	bool Intersect(const Ray& ray, RayHit* hit) const;
 
-	LinearBVHNode* GetNodeIterator() { return &m_Nodes[0]; }
+	// Root of the flattened tree, nullptr while the BVH is empty
+	LinearBVHNode* GetNodeIterator() { return m_Nodes.empty() ? nullptr : m_Nodes.data(); }
 
 private:
-	BVHBuildNode* build(std::vector<BVHPrimitiveInfo>& primitiveInfo, uint32_t start, uint32_t end, int* totalNodes, std::vector<Octree>& orderedPrims);
+	// Splits at the highest differing Morton bit, buildNodes is bumped for every node emitted
+	BVHBuildNode* emitLBVH(BVHBuildNode*& buildNodes, const std::vector<BVHPrimitiveInfo>& primitiveInfo, const std::pair<uint64_t, uint32_t>* mortonPrims,
+		uint32_t nPrimitives, int* totalNodes, std::vector<uint32_t>& orderedPrims, std::atomic<uint32_t>* orderedPrimsOffset, int bitIndex);
+
+	// Binned SAH over the treelet roots, buildNodes holds the 2 * (end - start) - 1 nodes of this subtree.
+	// Large ranges build both childs in parallel
+	BVHBuildNode* buildUpperSAH(BVHBuildNode* buildNodes, std::vector<BVHPrimitiveInfo>& treeletInfo, const std::vector<LBVHTreelet>& treelets, uint32_t start, uint32_t end, uint32_t depth);
+
+	void instanceBounds(const OctreeInstance& instance, glm::vec3& bounds_min, glm::vec3& bounds_max) const;
+
+	// Refits the nodes in [start, end) back to front, childs are always stored after their parent.
+	// Returns the unnormalized SAH cost of the range
+	float refitRange(uint32_t start, uint32_t end);
+
+	float refitNode(LinearBVHNode& node);
+
+	// SAH cost relative to the root area
+	float sahCost() const;
 
 	uint32_t flattenBVHTree(BVHBuildNode* node, uint32_t* offset);
 
-	bool findPossibleHits(const Ray& ray, const LinearBVHNode* node, RayHit* hit) const;
+	// Keeps the instance hits nearer than hit->Distance
+	bool intersectLeaf(const Ray& ray, const LinearBVHNode* node, RayHit* hit) const;
 
 private:
-	std::vector<Octree>& m_Primitives;
+	std::vector<Octree>& m_Assets;
+	std::vector<OctreeInstance>& m_Primitives;
+
+	// Instance ids in leaf order, the caller's instances are never reordered
+	std::vector<uint32_t> m_PrimitiveIndices;
 	std::vector<LinearBVHNode> m_Nodes;
 	int m_MaxPrimsInNode;
+
+	float m_BuildCost = 0;
 };
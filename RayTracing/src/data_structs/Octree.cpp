@@ -3,17 +3,27 @@
 #include "Walnut/Timer.h"
 
 #include "../utils/Utils.h"
+#include "../utils/ThreadPool.h"
 
 #include "../Core.h"
 
 #include <unordered_map>
 #include <map>
+#include <cstring>
+#include <climits>
+#include <cassert>
 
 Octree::Octree()
-	: m_Position(0), m_MaxDepth(0) {}
+	: m_MaxDepth(0), m_Layout(OctreeLayout::Standard), m_Traversal(OctreeTraversal::Parametric) {}
 
 void Octree::init(uint16_t size_x, uint16_t size_y, uint16_t size_z)
 {
+	m_Ropes.clear();
+	m_Distances.clear();
+	m_LodColors.clear();
+	for (std::vector<uint32_t>& free_blocks : m_FreeBlocks)
+		free_blocks.clear();
+
 	m_Nodes.emplace_back(1, u_shortV3{ 0 },
 		u_shortV3{ (uint16_t)(size_x - 1), (uint16_t)(size_y - 1), (uint16_t)(size_z - 1) });
 
@@ -22,6 +32,102 @@ void Octree::init(uint16_t size_x, uint16_t size_y, uint16_t size_z)
 	subdivide_node(node, firstChild);
 }
 
+void Octree::build(uint16_t size_x, uint16_t size_y, uint16_t size_z, const std::vector<Voxel>& voxels)
+{
+	m_Nodes.clear();
+	m_Ropes.clear();
+	m_Distances.clear();
+	m_LodColors.clear();
+	for (std::vector<uint32_t>& free_blocks : m_FreeBlocks)
+		free_blocks.clear();
+
+	m_Nodes.emplace_back(-1, u_shortV3{ 0 },
+		u_shortV3{ (uint16_t)(size_x - 1), (uint16_t)(size_y - 1), (uint16_t)(size_z - 1) });
+
+	if (voxels.size() == 0)
+		return;
+
+	ThreadPool& pool = ThreadPool::Get();
+
+	// Every split halves at least one axis
+	uint8_t levels = 0;
+	for (uint16_t size = std::max(size_x, std::max(size_y, size_z)) - 1; size > 0; size >>= 1)
+		levels++;
+
+	FULL_TRACE("Sort " << voxels.size() << " voxels");
+
+	const uint32_t key_batch = 4096;
+	std::vector<std::pair<uint64_t, uint32_t>> keys(voxels.size());
+	pool.ParallelFor(((uint32_t) voxels.size() + key_batch - 1) / key_batch, [&](uint32_t batch) {
+		uint32_t end = std::min((batch + 1) * key_batch, (uint32_t) voxels.size());
+		for (uint32_t i = batch * key_batch; i < end; i++)
+			keys[i] = { morton_key(voxels[i].x, voxels[i].y, voxels[i].z, levels), i };
+	});
+
+	Utils::RadixSort(keys, levels * 3);
+
+	OctreeNode* root = &m_Nodes[0];
+	if (root->bounds_is_zero())
+	{
+		std::vector<OctreeNode> nodes = { *root };
+		build_node(nodes, 0, keys, voxels, 0, (uint32_t) keys.size(), levels * 3);
+		m_Nodes = std::move(nodes);
+		return;
+	}
+
+	FULL_TRACE("Emit nodes");
+
+	// Root childs are independent subtrees, every one is built in its own buffer
+	root->flags |= 0x40000000; // has data 0b01
+
+	uint8_t count = root->child_count();
+
+	uint32_t first_child;
+	subdivide_node(root, first_child);
+
+	uint8_t shift = levels * 3 - 3;
+
+	uint32_t ranges[9] = { 0 };
+	for (uint8_t i = 0; i < count; i++)
+	{
+		ranges[i + 1] = ranges[i];
+		while (ranges[i + 1] < keys.size() && ((keys[ranges[i + 1]].first >> shift) & 0x7) == i)
+			ranges[i + 1]++;
+	}
+
+	std::vector<OctreeNode> subtrees[8];
+	pool.ParallelFor(count, [&](uint32_t i) {
+		if (ranges[i] == ranges[i + 1])
+			return;
+
+		subtrees[i] = { m_Nodes[first_child + i] };
+		subtrees[i].reserve((ranges[i + 1] - ranges[i]) * 3 / 2);
+		build_node(subtrees[i], 0, keys, voxels, ranges[i], ranges[i + 1], shift);
+	});
+
+	FULL_TRACE("Splice subtrees");
+
+	size_t total_size = m_Nodes.size();
+	for (uint8_t i = 0; i < count; i++)
+		total_size += subtrees[i].size() > 1 ? subtrees[i].size() - 1 : 0;
+	m_Nodes.reserve(total_size);
+
+	for (uint8_t i = 0; i < count; i++)
+	{
+		if (subtrees[i].size() == 0)
+			continue;
+
+		// Subtree node k > 0 lands at offset + k
+		uint32_t offset = (uint32_t) m_Nodes.size() - 1;
+		for (OctreeNode& node : subtrees[i])
+			if (node.first_child != -1)
+				node.first_child += offset;
+
+		m_Nodes[first_child + i] = subtrees[i][0];
+		m_Nodes.insert(m_Nodes.end(), subtrees[i].begin() + 1, subtrees[i].end());
+	}
+}
+
 void Octree::add_node(uint32_t first_child, u_shortV3 bottom_corner, u_shortV3 top_corner, uint32_t flags)
 {
 	m_Nodes.emplace_back(first_child, bottom_corner, top_corner, flags);
@@ -29,14 +135,16 @@ void Octree::add_node(uint32_t first_child, u_shortV3 bottom_corner, u_shortV3 t
 
 void Octree::insert_node(uint16_t x, uint16_t y, uint16_t z, uint32_t data)
 {
+	m_Ropes.clear();
+	m_Distances.clear();
+	m_LodColors.clear();
+
 	OctreeNode* node = &m_Nodes[0];
 	uint32_t curr_index = 0, prev_index = -1;
 
 	uint16_t mid_x, mid_y, mid_z;
 	uint8_t pos;
 
-	std::deque<uint32_t> try_collapse;
-
 	while (!node->bounds_is_zero())
 	{
 		mid_x = (uint16_t) ((node->bottom_corner.x + node->top_corner.x) / 2.0f);
@@ -84,34 +192,19 @@ void Octree::insert_node(uint16_t x, uint16_t y, uint16_t z, uint32_t data)
 			node = &m_Nodes[prev_index];
 		}
 
-		if (node->has_data() && prev_index != 0)
-			try_collapse.push_back(prev_index);
-		
 		node->flags |= 0x40000000; // has data 0b01
 		node = &m_Nodes[curr_index];
 	}
 
 	node->flags = 0xC0000000 | data; // has full data 0b11
-
-
-	// Try Collapse
-	if (try_collapse.size() == 0)
-		return;
-
-	std::sort(try_collapse.begin(), try_collapse.end(), std::greater<uint32_t>());
-
-	for (uint32_t i = 0; i < try_collapse.size(); i++)
-	{
-		std::vector<uint32_t> removed_m_Nodes = {};// collapse(try_collapse[i]);
-		if (removed_m_Nodes.size() == 0)
-			break;
-
-		int a = 0;
-	}
 }
 
 void Octree::insert_range_node(u_shortV3& min_bound, u_shortV3& max_bound, uint32_t data)
 {
+	m_Ropes.clear();
+	m_Distances.clear();
+	m_LodColors.clear();
+
 	std::queue<uint32_t> to_process = {};
 	to_process.push(0);
 
@@ -205,456 +298,1099 @@ void Octree::insert_range_node(u_shortV3& min_bound, u_shortV3& max_bound, uint3
 	}
 }
 
-void Octree::collapse_nodes()
+void Octree::set_voxel(uint16_t x, uint16_t y, uint16_t z, uint32_t data)
 {
-	FULL_TRACE("Check collapse paths");
+	fill_box({ x, y, z }, { x, y, z }, data);
+}
 
-	std::vector<std::pair<uint32_t, std::deque<uint32_t>>> collapse_paths = check_collapse_path(0);
+void Octree::clear_voxel(uint16_t x, uint16_t y, uint16_t z)
+{
+	fill_box({ x, y, z }, { x, y, z }, 0);
+}
 
-	std::sort(collapse_paths.begin(), collapse_paths.end(),
-		[](auto a, auto b)
-		{
-			return a.second.size() > b.second.size();
-		});
+void Octree::fill_box(const u_shortV3& min_bound, const u_shortV3& max_bound, uint32_t data)
+{
+	if (m_Layout != OctreeLayout::Standard)
+	{
+		LOG("Octree edits need the Standard layout");
+		return;
+	}
 
-	while (collapse_paths.size())
+	const u_shortV3& root_top = m_Nodes[0].top_corner;
+	u_shortV3 max_clip = { std::min(max_bound.x, root_top.x), std::min(max_bound.y, root_top.y), std::min(max_bound.z, root_top.z) };
+	if (min_bound.x > max_clip.x || min_bound.y > max_clip.y || min_bound.z > max_clip.z)
+		return;
+
+	// Ropes point at nodes an edit can split or free
+	m_Ropes.clear();
+
+	data &= 0x0FFFFFFF;
+	edit_box(0, min_bound, max_clip, data, 1);
+
+	if (data != 0 && has_distance_field())
+		fill_distance_field(min_bound, max_clip);
+}
+
+void Octree::apply_edits(const std::vector<Voxel>& edits)
+{
+	if (m_Layout != OctreeLayout::Standard)
 	{
-		FULL_TRACE("Process collapse depth: " << collapse_paths[0].second.size() << " paths: " << collapse_paths.size());
+		LOG("Octree edits need the Standard layout");
+		return;
+	}
+
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
 
-		// REFACTOR // CHANGE (Remove m_Nodes in the for loop) {
-		std::vector<std::pair<uint32_t, uint32_t>> to_remove;
-		to_remove.reserve(collapse_paths.size() * 8);
+	u_shortV3 root_top = m_Nodes[0].top_corner;
 
-		uint32_t start_delete_idx = -1, end_delete_idx = -1;
-		for (int i = collapse_paths.size() - 1; i >= 0; i--)
+	uint8_t levels = 0;
+	for (uint16_t size = root_top.max(); size > 0; size >>= 1)
+		levels++;
+
+	// Depth first order, every subtree is visited once for all of its edits
+	std::vector<std::pair<uint64_t, uint32_t>> keys;
+	keys.reserve(edits.size());
+	for (uint32_t i = 0; i < edits.size(); i++)
+	{
+		const Voxel& edit = edits[i];
+		if (edit.x <= root_top.x && edit.y <= root_top.y && edit.z <= root_top.z)
+			keys.emplace_back(morton_key(edit.x, edit.y, edit.z, levels), i);
+	}
+
+	if (keys.size() == 0)
+		return;
+
+	Utils::RadixSort(keys, levels * 3);
+
+	// Ropes point at nodes an edit can split or free
+	m_Ropes.clear();
+
+	edit_voxels(0, keys, edits, 0, (uint32_t) keys.size(), levels * 3, 1);
+
+	if (has_distance_field())
+	{
+		// Mark the new solid bricks, then relax the distances in their reach
+		int from[3] = { INT_MAX, INT_MAX, INT_MAX }, to[3] = { -1, -1, -1 };
+		for (const auto& [key, i] : keys)
 		{
-			auto& node_info = collapse_paths[i];
-			if (i != collapse_paths.size() - 1 && node_info.second[0] == collapse_paths[i + 1].second[0])
-			{
-				if (start_delete_idx == -1)
-				{
-					start_delete_idx = end_delete_idx = i + 1;
-				}
-				start_delete_idx--;
+			const Voxel& edit = edits[i];
+			if ((edit.data & 0x0FFFFFFF) == 0)
 				continue;
+
+			int brick[3] = { edit.x / DISTANCE_BRICK, edit.y / DISTANCE_BRICK, edit.z / DISTANCE_BRICK };
+			m_Distances[brick[0] + (brick[1] + brick[2] * m_DistanceGrid.y) * m_DistanceGrid.x] = 0;
+
+			for (uint8_t a = 0; a < 3; a++)
+			{
+				from[a] = std::min(from[a], brick[a]);
+				to[a] = std::max(to[a], brick[a]);
 			}
+		}
 
-			if (start_delete_idx != -1)
+		if (to[0] != -1)
+		{
+			for (uint8_t a = 0; a < 3; a++)
 			{
-				collapse_paths.erase(collapse_paths.begin() + start_delete_idx, collapse_paths.begin() + end_delete_idx);
-				start_delete_idx = end_delete_idx = -1;
+				from[a] = std::max(from[a] - 254, 0);
+				to[a] = std::min(to[a] + 254, m_DistanceGrid[a] - 1);
 			}
 
-			uint32_t first_child = m_Nodes[node_info.second[0]].first_child;
+			relax_distance_field(from, to);
+		}
+	}
 
-			if (first_child == -1)
-				continue;
+	LOG("Apply Edits: " << keys.size() << " edits in " << t.ElapsedMillis() << "ms");
+}
+
+void Octree::edit_box(uint32_t node_idx, const u_shortV3& min_bound, const u_shortV3& max_bound, uint32_t data, uint8_t depth)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	if (min_bound.x > node->top_corner.x || max_bound.x < node->bottom_corner.x ||
+		min_bound.y > node->top_corner.y || max_bound.y < node->bottom_corner.y ||
+		min_bound.z > node->top_corner.z || max_bound.z < node->bottom_corner.z)
+		return;
+
+	// Covered nodes become leaves, the root keeps its childs like after a collapse
+	if (min_bound <= node->bottom_corner && max_bound >= node->top_corner && (node_idx != 0 || node->bounds_is_zero()))
+	{
+		set_leaf(node_idx, data, depth);
+		return;
+	}
+
+	if (node->is_full() ? node->data() == data : (data == 0 && node->first_child == -1))
+		return;
+
+	if (node->is_full() || node->first_child == -1)
+		split_node(node_idx, depth);
+
+	node = &m_Nodes[node_idx];
+	node->calculate_format();
+
+	uint32_t first_child = node->first_child;
+	uint8_t count = node->child_count();
+	for (uint8_t i = 0; i < count; i++)
+		edit_box(first_child + i, min_bound, max_bound, data, depth + 1);
+
+	merge_childs(node_idx);
+}
 
-			// Check node can collapse
-			uint32_t sample_data = m_Nodes[first_child].data();
-			uint8_t child_count = m_Nodes[node_info.second[0]].child_count();
+void Octree::edit_voxels(uint32_t node_idx, const std::vector<std::pair<uint64_t, uint32_t>>& keys, const std::vector<Voxel>& edits,
+	uint32_t start, uint32_t end, uint8_t shift, uint8_t depth)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+
+	// Last edit wins on duplicates
+	if (node->bounds_is_zero())
+	{
+		set_leaf(node_idx, edits[keys[end - 1].second].data, depth);
+		return;
+	}
 
-			bool can_collapse = true;
-			for (uint8_t j = 1; j < child_count; j++)
+	// Leaves are only split when an edit changes their data
+	if (node->is_full() || node->first_child == -1)
+	{
+		uint32_t leaf_data = node->is_full() ? node->data() : 0;
+
+		uint32_t i = start;
+		while (i < end && (edits[keys[i].second].data & 0x0FFFFFFF) == leaf_data)
+			i++;
+
+		if (i == end)
+			return;
+
+		split_node(node_idx, depth);
+	}
+
+	node = &m_Nodes[node_idx];
+	node->calculate_format();
+
+	uint32_t first_child = node->first_child;
+	uint8_t count = node->child_count();
+
+	shift -= 3;
+
+	for (uint8_t i = 0; i < count && start < end; i++)
+	{
+		uint32_t child_end = start;
+		while (child_end < end && ((keys[child_end].first >> shift) & 0x7) == i)
+			child_end++;
+
+		if (child_end != start)
+			edit_voxels(first_child + i, keys, edits, start, child_end, shift, depth + 1);
+
+		start = child_end;
+	}
+
+	merge_childs(node_idx);
+}
+
+void Octree::set_leaf(uint32_t node_idx, uint32_t data, uint8_t depth)
+{
+	free_childs(node_idx);
+
+	OctreeNode* node = &m_Nodes[node_idx];
+	data &= 0x0FFFFFFF;
+	node->flags = data != 0 ? 0xC0000000 | data : 0; // has full data 0b11
+	node->calculate_format();
+
+	m_MaxDepth = std::max(m_MaxDepth, depth);
+}
+
+void Octree::split_node(uint32_t node_idx, uint8_t depth)
+{
+	// The childs start as copies of the leaf
+	OctreeNode* node = &m_Nodes[node_idx];
+	uint32_t leaf_flags = node->is_full() ? 0xC0000000 | node->data() : 0;
+
+	free_childs(node_idx);
+	node->flags = 0x40000000; // has data 0b01
+	node->calculate_format();
+
+	uint32_t first_child = alloc_childs(node_idx);
+	node = &m_Nodes[node_idx];
+
+	for (uint8_t i = 0; i < node->child_count(); i++)
+		m_Nodes[first_child + i].flags |= leaf_flags;
+
+	m_MaxDepth = std::max(m_MaxDepth, (uint8_t)(depth + 1));
+}
+
+void Octree::merge_childs(uint32_t node_idx)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	uint32_t first_child = node->first_child;
+	uint8_t count = node->child_count();
+
+	uint32_t sample_data = m_Nodes[first_child].data();
+	bool all_full = true, all_empty = true;
+	for (uint8_t i = 0; i < count; i++)
+	{
+		OctreeNode* sub_node = &m_Nodes[first_child + i];
+		all_full = all_full && sub_node->is_full() && sub_node->data() == sample_data;
+		all_empty = all_empty && !sub_node->is_full() && sub_node->first_child == -1;
+	}
+
+	// Equal childs are merged back, the root keeps its childs like after a collapse
+	if (node_idx != 0 && (all_full || all_empty))
+	{
+		free_childs(node_idx);
+		node->flags = all_full ? 0xC0000000 | sample_data : 0; // has full data with sample
+		node->calculate_format();
+		return;
+	}
+
+	node->flags = 0x40000000; // has data 0b01
+	node->calculate_format();
+
+	// Nodes added by splits get their LOD here too
+	if (has_lods())
+	{
+		m_LodColors.resize(m_Nodes.size());
+		m_LodColors[node_idx] = average_childs_lod(node_idx);
+	}
+}
+
+uint32_t Octree::alloc_childs(uint32_t node_idx)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	std::vector<uint32_t>& free_blocks = m_FreeBlocks[node->child_format() - 1];
+
+	uint32_t first_child;
+	if (free_blocks.size() == 0)
+	{
+		subdivide_node(node, first_child);
+		return first_child;
+	}
+
+	first_child = free_blocks.back();
+	free_blocks.pop_back();
+
+	u_shortV3 bot = node->bottom_corner, top = node->top_corner;
+	uint8_t count = node->child_count();
+	for (uint8_t i = 0; i < count; i++)
+		m_Nodes[first_child + i] = OctreeNode(bot, top, i, count);
+
+	node->first_child = first_child;
+	return first_child;
+}
+
+void Octree::free_childs(uint32_t node_idx)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	uint32_t first_child = node->first_child;
+	if (first_child == -1)
+		return;
+
+	node->first_child = -1;
+
+	// Full nodes can have lost their format bits
+	node->calculate_format();
+	uint8_t count = node->child_count();
+	for (uint8_t i = 0; i < count; i++)
+		free_childs(first_child + i);
+
+	m_FreeBlocks[node->child_format() - 1].push_back(first_child);
+}
+
+void Octree::fill_distance_field(const u_shortV3& min_bound, const u_shortV3& max_bound)
+{
+	// Filled bricks can only lower the distances, cleared ones leave a conservative
+	// distance behind. The field stays 1-Lipschitz, so growing shells around the box
+	// can stop at the first shell where nothing was lowered.
+	int bottom[3], top[3];
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		bottom[a] = min_bound[a] / DISTANCE_BRICK;
+		top[a] = max_bound[a] / DISTANCE_BRICK;
+	}
+
+	for (int r = 0; r < 255; r++)
+	{
+		bool lowered = false;
+		for (int z = std::max(bottom[2] - r, 0); z <= std::min(top[2] + r, m_DistanceGrid.z - 1); z++)
+			for (int y = std::max(bottom[1] - r, 0); y <= std::min(top[1] + r, m_DistanceGrid.y - 1); y++)
 			{
-				if ((m_Nodes[first_child + j].data()) != sample_data)
+				// Inner rows only have their two ends on the shell
+				bool inner = r > 0 && z > bottom[2] - r && z < top[2] + r && y > bottom[1] - r && y < top[1] + r;
+				int step = inner ? top[0] - bottom[0] + 2 * r : 1;
+
+				for (int x = bottom[0] - r; x <= top[0] + r; x += step)
 				{
-					can_collapse = false;
-					break;
+					if (x < 0 || x >= m_DistanceGrid.x)
+						continue;
+
+					uint8_t& brick = m_Distances[x + (y + z * m_DistanceGrid.y) * m_DistanceGrid.x];
+					if (brick > r)
+					{
+						brick = (uint8_t) r;
+						lowered = true;
+					}
 				}
 			}
 
-			if (!can_collapse)
-			{
-				collapse_paths.erase(collapse_paths.begin() + i);
-				continue;
-			}
+		if (!lowered)
+			break;
+	}
+}
 
-			// Remove all childs
-			for (uint8_t j = 0; j < child_count; j++)
-				to_remove.push_back({ first_child + j, node_info.first });
-		}
-		// REFACTOR // CHANGE }
+void Octree::collapse_nodes()
+{
+	FULL_TRACE("Collapse nodes");
 
-		if (to_remove.size() == 0)
-		{
-			// Remove all valid steps
-			for (int i = collapse_paths.size() - 1; i >= 0; i--)
-				collapse_paths.erase(collapse_paths.begin() + i);
+	m_Ropes.clear();
+	m_LodColors.clear();
+	for (std::vector<uint32_t>& free_blocks : m_FreeBlocks)
+		free_blocks.clear();
+
+	collapse_node(0);
+
+	FULL_TRACE("Compact nodes");
+
+	compact_nodes();
+}
+
+void Octree::build_lods()
+{
+	m_LodColors.clear();
+	if (m_Layout != OctreeLayout::Standard)
+		return;
+
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
+
+	OctreeNode* root = &m_Nodes[0];
+	if (root->is_full() || root->first_child == -1)
+		return;
 
+	m_LodColors.assign(m_Nodes.size(), 0);
+
+	// Subtrees two levels down are independent, up to 64 tasks for the pool
+	std::vector<uint32_t> subtrees;
+	for (uint8_t i = 0; i < root->child_count(); i++)
+	{
+		OctreeNode* sub_node = &m_Nodes[root->first_child + i];
+		if (sub_node->is_full() || sub_node->first_child == -1)
 			continue;
-		}
 
-		// Sort by descending
-		std::sort(to_remove.begin(), to_remove.end(),
-			[](auto& a, auto& b)
-			{
-				return a.first > b.first;
-			});
+		for (uint8_t j = 0; j < sub_node->child_count(); j++)
+			subtrees.push_back(sub_node->first_child + j);
+	}
 
-		FULL_TRACE("Deleting " << to_remove.size() << " m_Nodes");
+	ThreadPool::Get().ParallelFor((uint32_t) subtrees.size(), [&](uint32_t i) {
+		calculate_node_lod(subtrees[i]);
+	});
 
-		// Remove all m_Nodes
-		uint32_t start_idx = to_remove[0].first, end_idx = to_remove[0].first;
-		for (int i = 1; i < to_remove.size(); i++)
-		{
-			if (to_remove[i].first + 1 == start_idx)
-			{
-				start_idx = to_remove[i].first;
+	for (uint8_t i = 0; i < root->child_count(); i++)
+	{
+		OctreeNode* sub_node = &m_Nodes[root->first_child + i];
+		if (!sub_node->is_full() && sub_node->first_child != -1)
+			m_LodColors[root->first_child + i] = average_childs_lod(root->first_child + i);
+	}
 
-				if(i != to_remove.size() - 1)
-					continue;
-			}
+	m_LodColors[0] = average_childs_lod(0);
 
-			m_Nodes.erase(m_Nodes.begin() + start_idx, m_Nodes.begin() + end_idx + 1);
-			start_idx = end_idx = to_remove[i].first;
-		}
+	LOG("Build LODs: " << m_LodColors.size() * sizeof(uint32_t) / 1024.0f << " KB in " << t.ElapsedMillis() << "ms");
+}
 
+void Octree::calculate_max_depth()
+{
+	m_MaxDepth = find_max_depth(&m_Nodes[0]);
+}
 
-		// Reset all childs pointer
-		FULL_TRACE("Shifting all pointer");
+void Octree::calculate_bounds()
+{
+	OctreeNode* root = &m_Nodes[0];
+	if (root->is_full() || root->first_child == -1)
+		return;
+
+	// Subtrees two levels down are independent, as in build_lods
+	std::vector<uint32_t> subtrees;
+	set_childs_bounds(0);
+	for (uint8_t i = 0; i < root->child_count(); i++)
+	{
+		OctreeNode* sub_node = &m_Nodes[root->first_child + i];
+		if (sub_node->is_full() || sub_node->first_child == -1)
+			continue;
+
+		set_childs_bounds(root->first_child + i);
+		for (uint8_t j = 0; j < sub_node->child_count(); j++)
+			subtrees.push_back(sub_node->first_child + j);
+	}
+
+	ThreadPool::Get().ParallelFor((uint32_t) subtrees.size(), [&](uint32_t i) {
+		calculate_node_bounds(subtrees[i]);
+	});
+}
 
-		for (uint32_t i = 1; i < m_Nodes.size(); i++)
+void Octree::build_ropes()
+{
+	m_Ropes.clear();
+	if (m_Layout != OctreeLayout::Standard)
+		return;
+
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
+
+	m_Ropes.resize(m_Nodes.size() * 6, -1);
+
+	const u_shortV3 root_bottom = m_Nodes[0].bottom_corner, root_top = m_Nodes[0].top_corner;
+
+	const uint32_t batch_size = 4096;
+	uint32_t num_batches = (uint32_t)((m_Nodes.size() + batch_size - 1) / batch_size);
+	ThreadPool::Get().ParallelFor(num_batches, [&](uint32_t b) {
+		uint32_t end = std::min((uint32_t) m_Nodes.size(), (b + 1) * batch_size);
+		for (uint32_t i = b * batch_size; i < end; i++)
 		{
-			OctreeNode* sub_node = &m_Nodes[i];
-			if (sub_node->first_child == -1)
+			OctreeNode& node = m_Nodes[i];
+			if (!node.is_full() && !node.bounds_is_zero() && node.first_child != -1)
 				continue;
 
-			// Binary Search
-			int start_bound = 0, end_bound = to_remove.size() - 1, idx = -1;
-			while (end_bound >= start_bound)
+			// Link to the deepest node covering the slab of voxels next to each face
+			for (uint8_t face = 0; face < 6; face++)
 			{
-				int mid_bound = start_bound + (end_bound - start_bound) / 2;
+				uint8_t axis = face / 2;
+				u_shortV3 bottom = node.bottom_corner, top = node.top_corner;
+				uint16_t* bottom_axis = &bottom.x + axis;
+				uint16_t* top_axis = &top.x + axis;
 
-				if (to_remove[mid_bound].first == sub_node->first_child)
+				if (face & 1)
 				{
-					idx = mid_bound;
-					break;
-				}
+					if (node.top_corner[axis] == root_top[axis])
+						continue;
 
-				if (to_remove[mid_bound].first > sub_node->first_child)
+					*bottom_axis = *top_axis = node.top_corner[axis] + 1;
+				}
+				else
 				{
-					start_bound = mid_bound + 1;
-					continue;
+					if (node.bottom_corner[axis] == root_bottom[axis])
+						continue;
+
+					*bottom_axis = *top_axis = node.bottom_corner[axis] - 1;
 				}
 
-				end_bound = mid_bound - 1;
+				m_Ropes[i * 6 + face] = find_rope_node(bottom, top);
 			}
+		}
+	});
 
-			// If child removed, reset pointer
-			if (idx != -1)
-			{
-				sub_node->first_child = -1;
-				sub_node->flags = 0xC0000000 | to_remove[idx].second; // Has full data with sample
-				continue;
-			}
+	LOG("Build Ropes: " << m_Ropes.size() * sizeof(uint32_t) / 1024.0f << " KB in " << t.ElapsedMillis() << "ms");
+}
 
-			// Shift all pointers
-			uint32_t amount = 0;
-			if (sub_node->first_child >= to_remove[0].first)
-				amount = to_remove.size();
-			else if (sub_node->first_child >= to_remove[to_remove.size() - 1].first)
-			{
-				int start_bound = 0, end_bound = to_remove.size() - 1, idx = 0;
-				while (end_bound >= start_bound)
-				{
-					int mid_bound = start_bound + (end_bound - start_bound) / 2;
+void Octree::build_distance_field()
+{
+	m_Distances.clear();
+	if (m_Layout != OctreeLayout::Standard)
+		return;
 
-					if (to_remove[mid_bound].first <= sub_node->first_child && to_remove[mid_bound - 1].first > sub_node->first_child)
-					{
-						idx = mid_bound;
-						break;
-					}
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
+
+	const u_shortV3& top = m_Nodes[0].top_corner;
+	m_DistanceGrid = {
+		(uint16_t)(top.x / DISTANCE_BRICK + 1),
+		(uint16_t)(top.y / DISTANCE_BRICK + 1),
+		(uint16_t)(top.z / DISTANCE_BRICK + 1)
+	};
+
+	const int size_x = m_DistanceGrid.x, size_y = m_DistanceGrid.y, size_z = m_DistanceGrid.z;
+	m_Distances.assign(size_x * size_y * size_z, 255);
+
+	mark_solid_bricks(0);
+
+	int from[3] = { 0, 0, 0 }, to[3] = { size_x - 1, size_y - 1, size_z - 1 };
+	relax_distance_field(from, to);
+
+	LOG("Build Distance Field: " << m_Distances.size() / 1024.0f << " KB in " << t.ElapsedMillis() << "ms");
+}
 
-					if (to_remove[mid_bound].first > sub_node->first_child)
+void Octree::relax_distance_field(const int from[3], const int to[3])
+{
+	const int size_x = m_DistanceGrid.x, size_y = m_DistanceGrid.y, size_z = m_DistanceGrid.z;
+	const int region_x = to[0] - from[0] + 1, region_y = to[1] - from[1] + 1, region_z = to[2] - from[2] + 1;
+	const int count = region_x * region_y * region_z;
+
+	// Two pass chamfer over the 26 neighbours, exact for the Chebyshev metric.
+	// Distances only go down, the bricks outside the region keep theirs.
+	for (int pass = 0; pass < 2; pass++)
+	{
+		int dir = pass == 0 ? -1 : 1;
+		for (int i = 0; i < count; i++)
+		{
+			int r = pass == 0 ? i : count - 1 - i;
+			int x = from[0] + r % region_x, y = from[1] + (r / region_x) % region_y, z = from[2] + r / (region_x * region_y);
+			int idx = x + (y + z * size_y) * size_x;
+
+			int dist = m_Distances[idx];
+			if (dist == 0)
+				continue;
+
+			// Neighbours already visited by this pass
+			for (int dz = 0; dz <= 1; dz++)
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++)
 					{
-						start_bound = mid_bound + 1;
-						continue;
+						if (dz == 0 && (dy > 0 || (dy == 0 && dx >= 0)))
+							continue;
+
+						int nx = x + dx * -dir, ny = y + dy * -dir, nz = z + dz * dir;
+						if (nx < 0 || ny < 0 || nz < 0 || nx >= size_x || ny >= size_y || nz >= size_z)
+							continue;
+
+						dist = std::min(dist, m_Distances[nx + (ny + nz * size_y) * size_x] + 1);
 					}
 
-					end_bound = mid_bound - 1;
-				}
+			m_Distances[idx] = (uint8_t) std::min(dist, 255);
+		}
+	}
+}
 
-				if (idx <= 0)
-				{
-					int a = 0;
-				}
+bool Octree::set_layout(OctreeLayout layout)
+{
+	if (layout == m_Layout)
+		return true;
 
-				amount = to_remove.size() - idx;
-			}
+	if (layout == OctreeLayout::Brickmap)
+	{
+		if (m_Layout != OctreeLayout::Standard)
+		{
+			LOG("Brickmap layout is only built from the Standard layout");
+			return false;
+		}
 
-			/*
-			uint32_t amount = 0;
-			for (int j = to_remove.size() - 1; j >= 0; j--)
-			{
-				if (sub_node->first_child < to_remove[j].first)
-					break;
+		FULL_TRACE("Build brickmap");
 
-				amount++;
-			}
-			*/
+		std::vector<Voxel> voxels;
+		collect_voxels(voxels);
+
+		const u_shortV3& size = m_Nodes[0].top_corner;
+		m_Brickmap.build(size.x + 1, size.y + 1, size.z + 1, voxels);
+
+		// Keep the root only for the octree bounds, ropes and LODs index the dropped nodes
+		m_Ropes.clear();
+		m_LodColors.clear();
+		for (std::vector<uint32_t>& free_blocks : m_FreeBlocks)
+			free_blocks.clear();
+
+		m_Nodes.erase(m_Nodes.begin() + 1, m_Nodes.end());
+		m_Nodes.shrink_to_fit();
+		m_Nodes[0].first_child = -1;
 
-			sub_node->first_child -= amount;
+		m_Layout = OctreeLayout::Brickmap;
+		return true;
+	}
+
+	if (m_Layout == OctreeLayout::DAG || m_Layout == OctreeLayout::Brickmap || layout == OctreeLayout::Standard)
+	{
+		LOG("Octree layout conversion only goes Standard -> Compact -> DAG");
+		return false;
+	}
+
+	if (m_Layout == OctreeLayout::Standard)
+	{
+		// 24 bit child and data indices, the compact tree never has more nodes than the standard one
+		if (m_Nodes.size() > 0x1000000 || m_Materials.size() > 0x1000000)
+		{
+			LOG("Octree too large for the compact layout: " << m_Nodes.size() << " nodes, " << m_Materials.size() << " materials");
+			return false;
 		}
 
-		FULL_TRACE("Shifting all paths");
+		FULL_TRACE("Build compact nodes");
+
+		m_CompactNodes.clear();
+		m_CompactNodes.reserve(m_Nodes.size());
+		m_CompactNodes.emplace_back();
+
+		build_compact_node(0, 0);
+		m_CompactNodes.shrink_to_fit();
 
-		// Decrease valid steps
-		for (uint32_t i = 0; i < collapse_paths.size(); i++)
+		// Keep the root only for the octree bounds, ropes and LODs index the dropped nodes
+		m_Ropes.clear();
+		m_LodColors.clear();
+		for (std::vector<uint32_t>& free_blocks : m_FreeBlocks)
+			free_blocks.clear();
+
+		m_Nodes.erase(m_Nodes.begin() + 1, m_Nodes.end());
+		m_Nodes.shrink_to_fit();
+		m_Nodes[0].first_child = -1;
+
+		m_Layout = OctreeLayout::Compact;
+	}
+
+	if (layout == OctreeLayout::DAG)
+	{
+		FULL_TRACE("Build DAG nodes");
+
+		build_dag();
+		m_Layout = OctreeLayout::DAG;
+	}
+
+	return true;
+}
+
+void Octree::subdivide_node(OctreeNode*& node, uint32_t& first_child)
+{
+	node->first_child = first_child = (uint32_t) (m_Nodes.size());
+	u_shortV3 bot = node->bottom_corner, top = node->top_corner;
+	
+	uint8_t count = node->child_count();
+	for (uint8_t i = 0; i < count; i++)
+		m_Nodes.emplace_back(bot, top, i, count);
+}
+
+void Octree::build_compact_node(uint32_t node_idx, uint32_t compact_idx)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+
+	uint8_t valid_mask = 0, leaf_mask = 0;
+	uint32_t childs[8];
+
+	if (!node->is_full() && node->first_child != -1)
+	{
+		u_shortV3 mid = {
+			(uint16_t)((node->bottom_corner.x + node->top_corner.x) / 2.0f),
+			(uint16_t)((node->bottom_corner.y + node->top_corner.y) / 2.0f),
+			(uint16_t)((node->bottom_corner.z + node->top_corner.z) / 2.0f)
+		};
+
+		for (uint8_t i = 0; i < node->child_count(); i++)
 		{
-			auto& [_, path] = collapse_paths[i];
-			path.erase(path.begin());
+			OctreeNode* sub_node = &m_Nodes[node->first_child + i];
+			if (!sub_node->has_data())
+				continue;
 
-			// Shift all pointers
-			for (uint32_t p = 0; p < path.size(); p++)
-			{
-				// Binary Search lower elements
-				uint32_t amount = 0;
-				if (path[p] >= to_remove[0].first)
-					amount = to_remove.size();
-				else if (path[p] >= to_remove[to_remove.size() - 1].first)
-				{
-					int start_bound = 0, end_bound = to_remove.size() - 1, idx = 0;
-					while (end_bound >= start_bound)
-					{
-						int mid_bound = start_bound + (end_bound - start_bound) / 2;
+			// Non full leaves without childs are empty for the lookups too
+			if (!sub_node->is_full() && sub_node->first_child == -1)
+				continue;
 
-						if (to_remove[mid_bound].first <= path[p] && to_remove[mid_bound - 1].first > path[p])
-						{
-							idx = mid_bound;
-							break;
-						}
+			uint8_t pos = child_pos(sub_node->bottom_corner.x, sub_node->bottom_corner.y, sub_node->bottom_corner.z, mid);
 
-						if (to_remove[mid_bound].first > path[p])
-						{
-							start_bound = mid_bound + 1;
-							continue;
-						}
+			valid_mask |= 1 << pos;
+			if (sub_node->is_full())
+				leaf_mask |= 1 << pos;
 
-						end_bound = mid_bound - 1;
-					}
+			childs[pos] = node->first_child + i;
+		}
+	}
 
-					if (idx <= 0)
-					{
-						int a = 0;
-					}
+	uint32_t first_child = (uint32_t) m_CompactNodes.size();
+	m_CompactNodes.resize(first_child + CompactOctreeNode::popcount(valid_mask));
 
-					amount = to_remove.size() - idx;
-				}
+	CompactOctreeNode& compact = m_CompactNodes[compact_idx];
+	compact.child = (leaf_mask << 24) | (valid_mask ? first_child : 0);
+	compact.data_mask = (valid_mask << 24) | (node_data(node) & 0x00FFFFFF);
 
-				/*
-				uint32_t el = path[p];
-				uint32_t count = std::count_if(to_remove.begin(), to_remove.end(),
-					[&el](std::pair<uint32_t, uint32_t>& e)
-					{
-						return el > e.first;
-					});
-				*/
+	uint32_t compact_child = first_child;
+	for (uint8_t pos = 0; pos < 8; pos++)
+		if (valid_mask & (1 << pos))
+			build_compact_node(childs[pos], compact_child++);
+}
 
-				/*
-				uint32_t amount = 0;
-				for (int j = to_remove.size() - 1; j >= 0; j--)
-				{
-					if (path[p] < to_remove[j].first)
-						break;
+void Octree::index_colors()
+{
+	std::unordered_map<uint32_t, uint32_t> indices;
+	m_Materials = { Material{} };
 
-					amount++;
-				}
-				*/
+	for (OctreeNode& node : m_Nodes)
+	{
+		if (!node.is_full())
+			continue;
 
-				path[p] -= amount;
+		// Alpha and format bits can leak into the stored colour
+		uint32_t color = node.data() & 0x00FFFFFF;
+		auto [index, inserted] = indices.try_emplace(color, (uint32_t) m_Materials.size());
+		if (inserted)
+		{
+			if (m_Materials.size() == MAX_MATERIALS)
+			{
+				LOG("Octree has more than " << MAX_MATERIALS << " colours");
+				index->second = 0;
 			}
+			else
+				m_Materials.push_back({ Utils::DataToColor(color) });
 		}
 
-		to_remove.clear();
+		node.flags = (node.flags & 0xF0000000) | index->second;
+	}
+}
 
-		FULL_TRACE("Check empty paths");
+void Octree::collect_voxels(std::vector<Voxel>& voxels)
+{
+	if (m_Layout == OctreeLayout::Standard)
+		collect_voxels(0, voxels);
+}
 
-		// Remove all empty
-		for (int i = collapse_paths.size() - 1; i >= 0; i--)
-			if (collapse_paths[i].second.size() == 0)
-				collapse_paths.erase(collapse_paths.begin() + i);
+void Octree::collect_voxels(uint32_t node_idx, std::vector<Voxel>& voxels)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	if (node->is_full())
+	{
+		for (uint16_t z = node->bottom_corner.z; z <= node->top_corner.z; z++)
+			for (uint16_t y = node->bottom_corner.y; y <= node->top_corner.y; y++)
+				for (uint16_t x = node->bottom_corner.x; x <= node->top_corner.x; x++)
+					voxels.push_back({ x, y, z, node->data() });
+		return;
 	}
+
+	if (node->bounds_is_zero() || node->first_child == -1)
+		return;
+
+	uint32_t first_child = node->first_child;
+	uint8_t count = node->child_count();
+	for (uint8_t i = 0; i < count; i++)
+		collect_voxels(first_child + i, voxels);
 }
 
-void Octree::build_lods()
+void Octree::mark_solid_bricks(uint32_t node_idx)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	if (node->is_full())
+	{
+		for (uint16_t z = node->bottom_corner.z / DISTANCE_BRICK; z <= node->top_corner.z / DISTANCE_BRICK; z++)
+			for (uint16_t y = node->bottom_corner.y / DISTANCE_BRICK; y <= node->top_corner.y / DISTANCE_BRICK; y++)
+				for (uint16_t x = node->bottom_corner.x / DISTANCE_BRICK; x <= node->top_corner.x / DISTANCE_BRICK; x++)
+					m_Distances[x + (y + z * m_DistanceGrid.y) * m_DistanceGrid.x] = 0;
+		return;
+	}
+
+	if (node->bounds_is_zero() || node->first_child == -1)
+		return;
+
+	uint32_t first_child = node->first_child;
+	uint8_t count = node->child_count();
+	for (uint8_t i = 0; i < count; i++)
+		mark_solid_bricks(first_child + i);
+}
+
+uint8_t Octree::empty_distance(const glm::vec3& pos) const
 {
-	calculate_node_lod(&m_Nodes[0]);
+	uint16_t x = (uint16_t) pos.x / DISTANCE_BRICK, y = (uint16_t) pos.y / DISTANCE_BRICK, z = (uint16_t) pos.z / DISTANCE_BRICK;
+	return m_Distances[x + (y + z * m_DistanceGrid.y) * m_DistanceGrid.x];
 }
 
-void Octree::calculate_max_depth()
+void Octree::build_dag()
 {
-	m_MaxDepth = find_max_depth(&m_Nodes[0]);
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+	size_t tree_size = m_CompactNodes.size();
+#endif // RAY_DEBUG
+
+	std::vector<CompactOctreeNode> dag_nodes;
+	dag_nodes.reserve(m_CompactNodes.size());
+	dag_nodes.emplace_back();
+
+	std::unordered_map<std::string, uint32_t> blocks;
+	dag_nodes[0] = build_dag_node(0, m_Nodes[0].bottom_corner, m_Nodes[0].top_corner, dag_nodes, blocks);
+
+	dag_nodes.shrink_to_fit();
+	m_CompactNodes = std::move(dag_nodes);
+
+	LOG("Build DAG: " << tree_size << " -> " << m_CompactNodes.size() << " nodes in " << t.ElapsedMillis() << "ms");
 }
 
-void Octree::subdivide_node(OctreeNode*& node, uint32_t& first_child)
+CompactOctreeNode Octree::build_dag_node(uint32_t node_idx, const u_shortV3& bottom_corner, const u_shortV3& top_corner,
+	std::vector<CompactOctreeNode>& dag_nodes, std::unordered_map<std::string, uint32_t>& blocks)
 {
-	node->first_child = first_child = (uint32_t) (m_Nodes.size());
+	CompactOctreeNode node = m_CompactNodes[node_idx];
+	if (node.valid_mask() == 0)
+		return node;
+
+	// Childs first, so equal subtrees end up with equal child blocks
+	CompactOctreeNode childs[8];
+	uint8_t count = 0;
+	for (uint8_t pos = 0; pos < 8; pos++)
+	{
+		if ((node.valid_mask() & (1 << pos)) == 0)
+			continue;
+
+		u_shortV3 child_bottom, child_top;
+		child_bounds(bottom_corner, top_corner, pos, child_bottom, child_top);
+		childs[count++] = build_dag_node(node.child_index(pos), child_bottom, child_top, dag_nodes, blocks);
+	}
+
+	// Bounds are implicit, so the node size is part of the key
+	u_shortV3 size = { (uint16_t)(top_corner.x - bottom_corner.x), (uint16_t)(top_corner.y - bottom_corner.y), (uint16_t)(top_corner.z - bottom_corner.z) };
+
+	std::string key(sizeof(u_shortV3) + count * sizeof(CompactOctreeNode), '\0');
+	memcpy(&key[0], &size, sizeof(u_shortV3));
+	memcpy(&key[sizeof(u_shortV3)], childs, count * sizeof(CompactOctreeNode));
+
+	auto [block, inserted] = blocks.try_emplace(std::move(key), (uint32_t) dag_nodes.size());
+	if (inserted)
+		dag_nodes.insert(dag_nodes.end(), childs, childs + count);
+
+	node.child = (node.child & 0xFF000000) | block->second;
+	return node;
+}
+
+uint64_t Octree::morton_key(uint16_t x, uint16_t y, uint16_t z, uint8_t levels)
+{
+	// Child slot at every level, so the key order is the depth first order of the tree
+	OctreeNode node = m_Nodes[0];
+	uint64_t key = 0;
+
+	uint8_t level = 0;
+	while (!node.bounds_is_zero())
+	{
+		u_shortV3 mid = {
+			(uint16_t)((node.bottom_corner.x + node.top_corner.x) / 2.0f),
+			(uint16_t)((node.bottom_corner.y + node.top_corner.y) / 2.0f),
+			(uint16_t)((node.bottom_corner.z + node.top_corner.z) / 2.0f)
+		};
+
+		uint8_t pos = child_pos(x, y, z, mid);
+		Utils::OctreeIdxRemap(pos, &node);
+
+		key = (key << 3) | pos;
+		level++;
+
+		node = OctreeNode(node.bottom_corner, node.top_corner, pos, node.child_count());
+	}
+
+	return key << ((levels - level) * 3);
+}
+
+void Octree::build_node(std::vector<OctreeNode>& nodes, uint32_t node_idx, const std::vector<std::pair<uint64_t, uint32_t>>& keys,
+	const std::vector<Voxel>& voxels, uint32_t start, uint32_t end, uint8_t shift)
+{
+	OctreeNode* node = &nodes[node_idx];
+
+	// Last voxel wins on duplicates
+	if (node->bounds_is_zero())
+	{
+		node->flags = 0xC0000000 | voxels[keys[end - 1].second].data; // has full data 0b11
+		return;
+	}
+
+	node->flags |= 0x40000000; // has data 0b01
+
+	uint32_t first_child = node->first_child = (uint32_t) nodes.size();
 	u_shortV3 bot = node->bottom_corner, top = node->top_corner;
-	
+
 	uint8_t count = node->child_count();
 	for (uint8_t i = 0; i < count; i++)
-		m_Nodes.emplace_back(bot, top, i, count);
+		nodes.emplace_back(bot, top, i, count);
+
+	shift -= 3;
+
+	for (uint8_t i = 0; i < count && start < end; i++)
+	{
+		uint32_t child_end = start;
+		while (child_end < end && ((keys[child_end].first >> shift) & 0x7) == i)
+			child_end++;
+
+		if (child_end != start)
+			build_node(nodes, first_child + i, keys, voxels, start, child_end, shift);
+
+		start = child_end;
+	}
+
+	// Collapse, childs are the last nodes emitted
+	uint32_t sample_data = nodes[first_child].data();
+	for (uint8_t i = 0; i < count; i++)
+	{
+		OctreeNode* sub_node = &nodes[first_child + i];
+		if (!sub_node->is_full() || sub_node->data() != sample_data)
+			return;
+	}
+
+	nodes.erase(nodes.begin() + first_child, nodes.end());
+
+	node = &nodes[node_idx];
+	node->first_child = -1;
+	node->flags = 0xC0000000 | sample_data; // Has full data with sample
 }
 
-std::vector<std::pair<uint32_t, std::deque<uint32_t>>> Octree::check_collapse_path(uint32_t node_idx)
+bool Octree::collapse_node(uint32_t node_idx)
 {
 	OctreeNode* node = &m_Nodes[node_idx];
+	if (node->is_full())
+		return true;
+
 	if (node->first_child == -1)
-		return {};
+		return false;
+
+	// Post-order, every child is collapsed before its parent is checked
+	uint32_t first_child = node->first_child;
+	uint8_t count = node->child_count();
+
+	// The sample is read once the first child collapsed, it may only become full now
+	bool can_collapse = collapse_node(first_child);
+	uint32_t sample_data = m_Nodes[first_child].data();
+	for (uint8_t i = 1; i < count; i++)
+	{
+		if (!collapse_node(first_child + i) || m_Nodes[first_child + i].data() != sample_data)
+			can_collapse = false;
+	}
+
+	if (!can_collapse || node_idx == 0)
+		return false;
 
-	std::vector<std::pair<uint32_t, std::deque<uint32_t>>> paths;
+	node->first_child = -1;
+	node->flags = 0xC0000000 | sample_data; // Has full data with sample
+	return true;
+}
+
+void Octree::compact_nodes()
+{
+	// Mark nodes still reachable from the root
+	std::vector<uint32_t> remap(m_Nodes.size(), -1);
+	std::vector<uint32_t> to_process = { 0 };
+	remap[0] = 0;
 
-	uint32_t sample_data = m_Nodes[node->first_child].data();
-	bool valid_end_node = true;
-	for (uint8_t i = 0; i < node->child_count(); i++)
+	while (to_process.size() > 0)
 	{
-		uint32_t idx = node->first_child + i;
-		OctreeNode* sub_node = &m_Nodes[idx];
+		OctreeNode* node = &m_Nodes[to_process.back()];
+		to_process.pop_back();
+
+		if (node->first_child == -1)
+			continue;
 
-		if (!sub_node->has_data() ||
-			(sub_node->is_full() && (sub_node->data()) != sample_data))
+		// Childs of full nodes are never visited
+		if (node->is_full())
 		{
-			valid_end_node = false;
+			node->first_child = -1;
 			continue;
 		}
 
-		if (!sub_node->is_full())
-			valid_end_node = false;
+		for (uint8_t i = 0; i < node->child_count(); i++)
+		{
+			remap[node->first_child + i] = 0;
+			to_process.push_back(node->first_child + i);
+		}
+	}
+
+	// New index of every kept node, blocks of childs stay contiguous
+	uint32_t count = 0;
+	for (uint32_t& idx : remap)
+		if (idx != -1)
+			idx = count++;
 
-		std::vector<std::pair<uint32_t, std::deque<uint32_t>>> sub_paths = check_collapse_path(idx);
-		if (sub_paths.size() == 0)
+	for (uint32_t i = 0; i < m_Nodes.size(); i++)
+	{
+		if (remap[i] == -1)
 			continue;
 
-		if(paths.capacity() < paths.size() + sub_paths.size())
-			paths.reserve(paths.size() + sub_paths.size());
+		OctreeNode& node = m_Nodes[remap[i]];
+		node = m_Nodes[i];
 
-		paths.insert(paths.end(), sub_paths.begin(), sub_paths.end());
+		if (node.first_child != -1)
+			node.first_child = remap[node.first_child];
 	}
 
-	if (node_idx != 0)
-	{
-		if (paths.size() == 0)
-		{
-			if (valid_end_node && sample_data == 0)
-			{
-				int a = 0;
-			}
-
-			if (valid_end_node)
-				paths.push_back({ sample_data, { node_idx } });
-		}
-		else
-		{
-			for (uint32_t i = 0; i < paths.size(); i++)
-				paths[i].second.push_back(node_idx);
-		}
-	}
+	FULL_TRACE("Removed " << (m_Nodes.size() - count) << " nodes");
 
-	return paths;
+	m_Nodes.erase(m_Nodes.begin() + count, m_Nodes.end());
 }
 
-std::vector<uint32_t> Octree::collapse(uint32_t& node_idx)
+void Octree::calculate_node_lod(uint32_t node_idx)
 {
 	OctreeNode* node = &m_Nodes[node_idx];
-	if (node->first_child == -1)
-		return {};
-
-	// Check Collapse
-	auto [check, sample, checked_m_Nodes] = check_recursively_equal_childs(node);
-	if (!check || checked_m_Nodes.size() == 0)
-		return {};
+	if (node->is_full() || node->first_child == -1)
+		return;
 
-	// Collapse
-	remove_nodes(checked_m_Nodes);
-	
-	// Reset all childs pointer
-	for (uint32_t i = 0; i < m_Nodes.size(); i++)
-	{
-		OctreeNode* sub_node = &m_Nodes[i];
-		if (sub_node->first_child == -1)
-			continue;
+	for (uint8_t i = 0; i < node->child_count(); i++)
+		calculate_node_lod(node->first_child + i);
 
-		if (std::find(checked_m_Nodes.begin(), checked_m_Nodes.end(), sub_node->first_child) != checked_m_Nodes.end())
-		{
-			sub_node->first_child = -1;
-			sub_node->flags = 0xC0000000 | sample; // Has full data with sample
-			continue;
-		}
+	m_LodColors[node_idx] = average_childs_lod(node_idx);
+}
 
-		// Shift all pointers
-		uint32_t amount = 0;
-		for (int j = checked_m_Nodes.size() - 1; j >= 0; j--)
-		{
-			if (sub_node->first_child < checked_m_Nodes[j])
-				break;
+void Octree::calculate_node_bounds(uint32_t node_idx)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	if (node->is_full() || node->first_child == -1)
+		return;
 
-			amount++;
-		}
+	set_childs_bounds(node_idx);
+	for (uint8_t i = 0; i < node->child_count(); i++)
+		calculate_node_bounds(node->first_child + i);
+}
 
-		sub_node->first_child -= amount;
-	}
+void Octree::set_childs_bounds(uint32_t node_idx)
+{
+	OctreeNode* node = &m_Nodes[node_idx];
+	u_shortV3 bottom_corner = node->bottom_corner, top_corner = node->top_corner;
 
-	return checked_m_Nodes;
+	uint8_t count = node->child_count();
+	for (uint8_t i = 0; i < count; i++)
+		m_Nodes[node->first_child + i].calc_corners_by_pos_id(bottom_corner, top_corner, i, count);
 }
 
-std::tuple<bool, uint32_t, std::vector<uint32_t>> Octree::check_recursively_equal_childs(OctreeNode* node)
+uint32_t Octree::average_childs_lod(uint32_t node_idx)
 {
-	std::vector<uint32_t> checked_m_Nodes;
+	OctreeNode* node = &m_Nodes[node_idx];
 
-	uint32_t sample_data = m_Nodes[node->first_child].data();
+	// Colours weighted by the covered volume of every child
+	double covered = 0, r = 0, g = 0, b = 0;
 	for (uint8_t i = 0; i < node->child_count(); i++)
 	{
 		OctreeNode* sub_node = &m_Nodes[node->first_child + i];
-		if (!sub_node->is_full() ||
-			(sub_node->data()) != sample_data)
-			return { false, 0, {} };
+		uint32_t lod = child_lod(node->first_child + i);
 
-		if (sub_node->first_child != -1)
-		{
-			auto [check, _, proc_m_Nodes] = check_recursively_equal_childs(sub_node);
-			if (sub_node->first_child != -1 && !check)
-				return { false, 0, {} };
-
-			checked_m_Nodes.insert(checked_m_Nodes.end(), proc_m_Nodes.begin(), proc_m_Nodes.end());
-		}
+		double weight = (lod >> 24) * (sub_node->top_corner.x - sub_node->bottom_corner.x + 1.0) *
+			(sub_node->top_corner.y - sub_node->bottom_corner.y + 1.0) * (sub_node->top_corner.z - sub_node->bottom_corner.z + 1.0);
 
-		checked_m_Nodes.push_back(node->first_child + i);
+		covered += weight;
+		r += weight * ((lod >> 16) & 0xFF);
+		g += weight * ((lod >> 8) & 0xFF);
+		b += weight * (lod & 0xFF);
 	}
 
-	return { true, sample_data, checked_m_Nodes };
+	if (covered == 0)
+		return 0;
+
+	double volume = (node->top_corner.x - node->bottom_corner.x + 1.0) *
+		(node->top_corner.y - node->bottom_corner.y + 1.0) * (node->top_corner.z - node->bottom_corner.z + 1.0);
+
+	// Any data keeps a coverage of at least 1
+	uint32_t coverage = std::max((uint32_t) (covered / volume + 0.5), 1u);
+	return (coverage << 24) | ((uint32_t) (r / covered + 0.5) << 16) | ((uint32_t) (g / covered + 0.5) << 8) | (uint32_t) (b / covered + 0.5);
 }
 
-void Octree::remove_nodes(std::vector<uint32_t>& sub_m_Nodes)
+uint32_t Octree::child_lod(uint32_t node_idx)
 {
-	// Sort by descending
-	std::sort(sub_m_Nodes.begin(), sub_m_Nodes.end(), std::greater<uint32_t>());
+	OctreeNode* node = &m_Nodes[node_idx];
+	if (node->is_full())
+		return 0xFF000000 | Utils::ColorToData(resolve_material(node->data(), false).Color);
 
-	// Remove all m_Nodes
-	for (uint32_t& idx : sub_m_Nodes)
-	{
-		m_Nodes.erase(m_Nodes.begin() + idx);
-	}
+	if (node->first_child == -1)
+		return 0;
+
+	return m_LodColors[node_idx];
 }
 
-uint32_t Octree::calculate_node_lod(OctreeNode* node)
+uint32_t Octree::node_data(OctreeNode* node)
 {
 	if (node->is_full() || node->first_child == -1)
 		return node->data();
 
-	std::map<uint32_t, uint8_t> data_count;
-	for (uint8_t i = 0; i < node->child_count(); i++)
-	{
-		uint32_t data = calculate_node_lod(&m_Nodes[node->first_child + i]);
-		data_count[data]++;
-	}
+	// Interior nodes are only returned on LOD stops
+	uint32_t node_idx = (uint32_t) (node - &m_Nodes[0]);
+	return node_idx < m_LodColors.size() ? m_LodColors[node_idx] & 0x00FFFFFF : 0;
+}
+
+uint8_t Octree::node_coverage(OctreeNode* node)
+{
+	if (node->is_full())
+		return 0xFF;
+
+	if (node->first_child == -1)
+		return 0;
+
+	uint32_t node_idx = (uint32_t) (node - &m_Nodes[0]);
+	return node_idx < m_LodColors.size() ? m_LodColors[node_idx] >> 24 : 0;
+}
 
-	uint32_t data = data_count.begin()->first;
-	if (data_count.begin()->first == 0 && data_count.size() > 1)
-		data = (++data_count.begin())->first;
+Material Octree::resolve_material(uint32_t data, bool is_lod) const
+{
+	if (is_lod)
+		return { Utils::DataToColor(data) };
 
-	node->flags |= data;
-	return data;
+	return data < m_Materials.size() ? m_Materials[data] : Material{};
 }
 
 uint8_t Octree::find_max_depth(OctreeNode* node)
@@ -738,7 +1474,7 @@ bool Octree::find_node(uint16_t x, uint16_t y, uint16_t z, OctreeNode* node, Oct
 	{
 		max_depth = -2;
 		result = node;
-		return result->data() != 0;
+		return node_coverage(result) != 0;
 	}
 
 	if (node->bounds_is_zero())
@@ -806,6 +1542,127 @@ bool Octree::find_node(uint16_t x, uint16_t y, uint16_t z, OctreeNode* node, Oct
 	return find_node(x, y, z, &m_Nodes[node->first_child + pos], result, --max_depth);
 }
 
+uint32_t Octree::find_rope_node(const u_shortV3& bottom_corner, const u_shortV3& top_corner)
+{
+	uint32_t node_idx = 0;
+	while (true)
+	{
+		OctreeNode* node = &m_Nodes[node_idx];
+		if (node->is_full() || node->bounds_is_zero() || node->first_child == -1)
+			return node_idx;
+
+		u_shortV3 mid = {
+			(uint16_t)((node->bottom_corner.x + node->top_corner.x) / 2.0f),
+			(uint16_t)((node->bottom_corner.y + node->top_corner.y) / 2.0f),
+			(uint16_t)((node->bottom_corner.z + node->top_corner.z) / 2.0f)
+		};
+
+		// Stop at the node whose childs split the region
+		uint8_t pos = child_pos(bottom_corner.x, bottom_corner.y, bottom_corner.z, mid);
+		if (pos != child_pos(top_corner.x, top_corner.y, top_corner.z, mid))
+			return node_idx;
+
+		Utils::OctreeIdxRemap(pos, node);
+		node_idx = node->first_child + pos;
+	}
+}
+
+bool Octree::find_node_by_rope(uint16_t x, uint16_t y, uint16_t z, OctreeNode* leaf, uint8_t face, OctreeNodeRef& result)
+{
+	uint32_t rope = m_Ropes[(leaf - &m_Nodes[0]) * 6 + face];
+
+	OctreeNode* node;
+	short max_depth = -1;
+	bool found = find_node(x, y, z, rope == -1 ? &m_Nodes[0] : &m_Nodes[rope], node, max_depth);
+
+	result = { node, node->bottom_corner, node->top_corner, node_data(node), node->has_data(), !node->is_full() && node->first_child != -1 };
+	return found;
+}
+
+uint16_t Octree::find_compact_node_data(uint16_t x, uint16_t y, uint16_t z)
+{
+	const CompactOctreeNode* node = &m_CompactNodes[0];
+	if (node->valid_mask() == 0)
+		return node->data();
+
+	u_shortV3 bottom_corner = m_Nodes[0].bottom_corner, top_corner = m_Nodes[0].top_corner;
+	while (true)
+	{
+		u_shortV3 mid = {
+			(uint16_t)((bottom_corner.x + top_corner.x) / 2.0f),
+			(uint16_t)((bottom_corner.y + top_corner.y) / 2.0f),
+			(uint16_t)((bottom_corner.z + top_corner.z) / 2.0f)
+		};
+
+		uint8_t pos = child_pos(x, y, z, mid);
+		if ((node->valid_mask() & (1 << pos)) == 0)
+			return 0;
+
+		if (node->leaf_mask() & (1 << pos))
+			return m_CompactNodes[node->child_index(pos)].data();
+
+		child_bounds(bottom_corner, top_corner, pos, bottom_corner, top_corner);
+		node = &m_CompactNodes[node->child_index(pos)];
+	}
+}
+
+bool Octree::find_compact_node(uint16_t x, uint16_t y, uint16_t z, OctreeNodeRef& result, short& max_depth)
+{
+	const CompactOctreeNode* node = &m_CompactNodes[0];
+	bool is_leaf = node->valid_mask() == 0 && node->data() != 0;
+
+	result.node = nullptr;
+	result.bottom_corner = m_Nodes[0].bottom_corner;
+	result.top_corner = m_Nodes[0].top_corner;
+	result.is_lod = false;
+
+	// Same steps as the Standard find_node, with bounds derived on the way down
+	while (true)
+	{
+		result.data = node->data();
+		result.has_data = is_leaf || node->valid_mask() != 0;
+
+		if (is_leaf)
+			return true;
+
+		if (max_depth == 0)
+		{
+			max_depth = -2;
+			result.is_lod = true;
+
+			// Interior nodes only, black averages are still occupied
+			return node->valid_mask() != 0;
+		}
+
+		if (node->valid_mask() == 0)
+			return false;
+
+		u_shortV3 mid = {
+			(uint16_t)((result.bottom_corner.x + result.top_corner.x) / 2.0f),
+			(uint16_t)((result.bottom_corner.y + result.top_corner.y) / 2.0f),
+			(uint16_t)((result.bottom_corner.z + result.top_corner.z) / 2.0f)
+		};
+
+		uint8_t pos = child_pos(x, y, z, mid);
+		child_bounds(result.bottom_corner, result.top_corner, pos, result.bottom_corner, result.top_corner);
+		--max_depth;
+
+		// Empty child
+		if ((node->valid_mask() & (1 << pos)) == 0)
+		{
+			if (max_depth == 0)
+				max_depth = -2;
+
+			result.data = 0;
+			result.has_data = false;
+			return false;
+		}
+
+		is_leaf = node->leaf_mask() & (1 << pos);
+		node = &m_CompactNodes[node->child_index(pos)];
+	}
+}
+
 // Math3D OCtree https://www.math3d.org/QtfRmk23Y
 bool Octree::proc_ray_travel(const Ray& ray, OctreeNode* node, RayHit* hit)
 {
@@ -816,6 +1673,7 @@ bool Octree::proc_ray_travel(const Ray& ray, OctreeNode* node, RayHit* hit)
 	{
 		hit->Position = {};
 		hit->Node = nullptr;
+		hit->Data = 0;
 		hit->Normal = {};
 		return false;
 	}
@@ -839,33 +1697,51 @@ bool Octree::proc_ray_travel(const Ray& ray, OctreeNode* node, RayHit* hit)
 	const int maxTrace = ray.MaxDistance - d;
 
 	bool isInBox = false;
-	OctreeNode* subNode = nullptr;
+	bool hasSubNode = false;
+	OctreeNodeRef subNode{};
 
 	// LOD
 	d = glm::distance(node->top_corner + glm::vec3(0.5), ray.Origin);
 	short max_depth = Utils::GetLOD(d, m_Nodes[0].top_corner.max(), m_MaxDepth);
 	// LOD
 
+	// Ropes skip the depth count, only usable without LOD
+	bool use_ropes = max_depth < 0 && has_ropes();
+
+	// A coarse LOD node can be hit inside empty bricks, so no jumps with LOD either
+	bool use_distances = max_depth < 0 && has_distance_field();
+
 	for (int i = 0; i < maxTrace; i++)
 	{
-		if (subNode == nullptr || subNode->has_data() || !point_in_box(subNode->bottom_corner, subNode->top_corner, pos))
+		if (!hasSubNode || subNode.has_data || !point_in_box(subNode.bottom_corner, subNode.top_corner, pos))
 		{
 			if (point_in_box(node->bottom_corner, node->top_corner, pos))
 			{
 				isInBox = true;
 				short depth = max_depth;
-				if (find_node((uint16_t)pos.x, (uint16_t)pos.y, (uint16_t)pos.z, subNode, depth))
+				bool found;
+				if (use_ropes && hasSubNode)
+				{
+					// Left the empty subNode through the face of the last step
+					uint8_t axis = norm.x != 0 ? 0 : (norm.y != 0 ? 1 : 2);
+					found = find_node_by_rope((uint16_t)pos.x, (uint16_t)pos.y, (uint16_t)pos.z, subNode.node, axis * 2 + (norm[axis] < 0), subNode);
+				}
+				else
+					found = find_node((uint16_t)pos.x, (uint16_t)pos.y, (uint16_t)pos.z, subNode, depth);
+				hasSubNode = true;
+
+				if (found)
 				{
 					if (depth == -2)
 					{
-						ray_pos = ray.Origin + ray.Direction * ray_intersect_box(subNode->bottom_corner, subNode->top_corner, ray);
-
-						if (std::abs(ray_pos.x - subNode->bottom_corner.x) < 0.0001f) norm = glm::vec3(-1, 0, 0);
-						else if (std::abs(ray_pos.y - subNode->bottom_corner.y) < 0.0001f) norm = glm::vec3(0, -1, 0);
-						else if (std::abs(ray_pos.z - subNode->bottom_corner.z) < 0.0001f) norm = glm::vec3(0, 0, -1);
-						else if (std::abs(ray_pos.x - subNode->top_corner.x - 1) < 0.0001f) norm = glm::vec3(1, 0, 0);
-						else if (std::abs(ray_pos.y - subNode->top_corner.y - 1) < 0.0001f) norm = glm::vec3(0, 1, 0);
-						else if (std::abs(ray_pos.z - subNode->top_corner.z - 1) < 0.0001f) norm = glm::vec3(0, 0, 1);
+						ray_pos = ray.Origin + ray.Direction * ray_intersect_box(subNode.bottom_corner, subNode.top_corner, ray);
+
+						if (std::abs(ray_pos.x - subNode.bottom_corner.x) < 0.0001f) norm = glm::vec3(-1, 0, 0);
+						else if (std::abs(ray_pos.y - subNode.bottom_corner.y) < 0.0001f) norm = glm::vec3(0, -1, 0);
+						else if (std::abs(ray_pos.z - subNode.bottom_corner.z) < 0.0001f) norm = glm::vec3(0, 0, -1);
+						else if (std::abs(ray_pos.x - subNode.top_corner.x - 1) < 0.0001f) norm = glm::vec3(1, 0, 0);
+						else if (std::abs(ray_pos.y - subNode.top_corner.y - 1) < 0.0001f) norm = glm::vec3(0, 1, 0);
+						else if (std::abs(ray_pos.z - subNode.top_corner.z - 1) < 0.0001f) norm = glm::vec3(0, 0, 1);
 						else
 						{
 							glm::vec3 round_pos = glm::round(ray_pos);
@@ -902,8 +1778,10 @@ bool Octree::proc_ray_travel(const Ray& ray, OctreeNode* node, RayHit* hit)
 					}
 
 					hit->Position = pos;
-					hit->Node = subNode;
+					hit->Node = subNode.node;
+					hit->Data = subNode.data;
 					hit->Normal = norm;
+					hit->Surface = resolve_material(subNode.data, subNode.is_lod);
 					return true;
 				}
 			}
@@ -911,6 +1789,37 @@ bool Octree::proc_ray_travel(const Ray& ray, OctreeNode* node, RayHit* hit)
 				break;
 		}
 
+		// Jump out of the block of empty bricks around pos
+		uint8_t dist = use_distances && isInBox ? empty_distance(pos) : 0;
+		if (dist > 0)
+		{
+			glm::vec3 brick = glm::floor(pos / (float) DISTANCE_BRICK);
+			glm::vec3 bottom = (brick - (float)(dist - 1)) * (float) DISTANCE_BRICK;
+			glm::vec3 top = (brick + (float) dist) * (float) DISTANCE_BRICK - 1.0f;
+
+			uint8_t axis;
+			float t = ray_exit_box(bottom, top, ray, axis);
+
+			ray_pos = ray.Origin + ray.Direction * t;
+			pos = glm::floor(ray_pos);
+			pos[axis] = step[axis] > 0 ? top[axis] + 1 : bottom[axis] - 1;
+			for (uint8_t a = 0; a < 3; a++)
+				if (a != axis)
+					pos[a] = glm::clamp(pos[a], bottom[a], top[a]);
+
+			norm = glm::vec3(0);
+			norm[axis] = -step[axis];
+
+			fr = ray_pos - pos;
+			tMaxX = tDelta.x * ((ray.Direction.x > 0.0) ? (1.0f - fr.x) : fr.x);
+			tMaxY = tDelta.y * ((ray.Direction.y > 0.0) ? (1.0f - fr.y) : fr.y);
+			tMaxZ = tDelta.z * ((ray.Direction.z > 0.0) ? (1.0f - fr.z) : fr.z);
+
+			// The cached subNode is not adjacent anymore
+			hasSubNode = false;
+			continue;
+		}
+
 		if (tMaxX < tMaxY) {
 			if (tMaxZ < tMaxX) {
 				tMaxZ += tDelta.z;
@@ -939,10 +1848,219 @@ bool Octree::proc_ray_travel(const Ray& ray, OctreeNode* node, RayHit* hit)
 
 	hit->Position = {};
 	hit->Node = nullptr;
+	hit->Data = 0;
+	hit->Normal = {};
+	return false;
+}
+
+// Top-down parametric traversal (Revelles/ESVO): descend into the child the ray is in at t.
+// An empty child moves t to its exit face and the ray to the sibling behind that face,
+// parents are only popped when the face is theirs as well.
+bool Octree::proc_ray_travel_parametric(const Ray& ray, RayHit* hit)
+{
+	const u_shortV3& bottom_corner = m_Nodes[0].bottom_corner;
+	const u_shortV3& top_corner = m_Nodes[0].top_corner;
+
+	float t = ray_intersect_box(bottom_corner, top_corner, ray);
+	glm::vec3 norm{};
+	if (t < 0)
+	{
+		if (!point_in_box(bottom_corner, top_corner, glm::floor(ray.Origin)))
+		{
+			hit->Position = {};
+			hit->Node = nullptr;
+			hit->Data = 0;
+			hit->Normal = {};
+			return false;
+		}
+
+		// Starting inside, face the major axis
+		t = 0;
+		glm::vec3 dir = glm::abs(ray.Direction);
+		if (dir.x >= dir.y && dir.x >= dir.z) norm = glm::vec3(-glm::sign(ray.Direction.x), 0, 0);
+		else if (dir.y >= dir.z)              norm = glm::vec3(0, -glm::sign(ray.Direction.y), 0);
+		else                                  norm = glm::vec3(0, 0, -glm::sign(ray.Direction.z));
+	}
+	else
+	{
+		// Entry face is the axis with the latest near plane
+		float near_t = -FLT_MAX;
+		for (uint8_t a = 0; a < 3; a++)
+		{
+			if (ray.Direction[a] == 0)
+				continue;
+
+			float plane = ray.Direction[a] > 0 ? bottom_corner[a] : top_corner[a] + 1.0f;
+			float t_a = (plane - ray.Origin[a]) * ray.InvDirection[a];
+			if (t_a > near_t)
+			{
+				near_t = t_a;
+				norm = glm::vec3(0);
+				norm[a] = -glm::sign(ray.Direction[a]);
+			}
+		}
+	}
+
+	// LOD
+	float d = glm::distance(top_corner + glm::vec3(0.5), ray.Origin);
+	short max_depth = Utils::GetLOD(d, top_corner.max(), m_MaxDepth);
+	// LOD
+
+	const bool compact = has_compact_nodes();
+
+	OctreeTraversalFrame stack[MAX_LEVELS];
+	uint8_t level = 0;
+
+	// Current node, starting at the root
+	u_shortV3 bottom = bottom_corner, top = top_corner;
+	uint32_t node_idx = 0;
+	bool is_leaf = compact && m_CompactNodes[0].valid_mask() == 0 && m_CompactNodes[0].data() != 0;
+	bool is_empty = false;
+
+	while (t < ray.MaxDistance)
+	{
+		bool descend = false;
+		if (!is_empty)
+		{
+			bool found = false, is_lod = false;
+			uint32_t data = 0;
+			if (compact)
+			{
+				const CompactOctreeNode& node = m_CompactNodes[node_idx];
+				data = node.data();
+				if (is_leaf)
+					found = true;
+				else if (level == max_depth)
+					found = is_lod = node.valid_mask() != 0;
+				else
+					descend = node.valid_mask() != 0;
+			}
+			else
+			{
+				OctreeNode* node = &m_Nodes[node_idx];
+				data = node_data(node);
+				if (node->is_full())
+					found = true;
+				else if (level == max_depth)
+				{
+					found = node_coverage(node) != 0;
+					is_lod = node->first_child != -1;
+				}
+				else
+					descend = !node->bounds_is_zero() && node->first_child != -1;
+			}
+
+			if (found)
+			{
+				hit->Position = glm::clamp(glm::floor(ray.Origin + ray.Direction * t), bottom + glm::vec3(0), top + glm::vec3(0));
+				hit->Node = compact ? nullptr : &m_Nodes[node_idx];
+				hit->Data = data;
+				hit->Normal = norm;
+				hit->Surface = resolve_material(data, is_lod);
+				return true;
+			}
+		}
+
+		if (descend)
+		{
+			assert(level < MAX_LEVELS);
+			stack[level++] = { node_idx, bottom, top, ray_child_pos(bottom, top, ray, t) };
+		}
+		else
+		{
+			// Skip the whole empty node
+			uint8_t axis;
+			t = std::max(t, ray_exit_box(bottom, top, ray, axis));
+
+			norm = glm::vec3(0);
+			norm[axis] = -glm::sign(ray.Direction[axis]);
+
+			// The parents the ray leaves through the same face
+			bool positive = ray.Direction[axis] > 0;
+			while (level > 0 && (positive ? top[axis] == stack[level - 1].top_corner[axis] : bottom[axis] == stack[level - 1].bottom_corner[axis]))
+			{
+				level--;
+				bottom = stack[level].bottom_corner;
+				top = stack[level].top_corner;
+			}
+
+			// Left the root
+			if (level == 0)
+				break;
+
+			stack[level - 1].pos ^= axis == 0 ? 2 : (axis == 1 ? 4 : 1);
+		}
+
+		// Enter the child the ray is in now
+		OctreeTraversalFrame& parent = stack[level - 1];
+		child_bounds(parent.bottom_corner, parent.top_corner, parent.pos, bottom, top);
+
+		if (compact)
+		{
+			const CompactOctreeNode& node = m_CompactNodes[parent.node];
+			is_empty = (node.valid_mask() & (1 << parent.pos)) == 0;
+			is_leaf = node.leaf_mask() & (1 << parent.pos);
+			node_idx = is_empty ? 0 : node.child_index(parent.pos);
+		}
+		else
+		{
+			uint8_t pos = parent.pos;
+			Utils::OctreeIdxRemap(pos, &m_Nodes[parent.node]);
+			node_idx = m_Nodes[parent.node].first_child + pos;
+		}
+	}
+
+	hit->Position = {};
+	hit->Node = nullptr;
+	hit->Data = 0;
 	hit->Normal = {};
 	return false;
 }
 
+float Octree::ray_exit_box(const u_shortV3& min, const u_shortV3& max, const Ray& ray, uint8_t& axis)
+{
+	float tmax = FLT_MAX;
+	axis = 0;
+
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		if (ray.Direction[a] == 0)
+			continue;
+
+		float plane = ray.Direction[a] > 0 ? max[a] + 1.0f : min[a];
+		float t = (plane - ray.Origin[a]) * ray.InvDirection[a];
+		if (t < tmax)
+		{
+			tmax = t;
+			axis = a;
+		}
+	}
+
+	return tmax;
+}
+
+float Octree::ray_exit_box(const glm::vec3& min, const glm::vec3& max, const Ray& ray, uint8_t& axis)
+{
+	float tmax = FLT_MAX;
+	axis = 0;
+
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		if (ray.Direction[a] == 0)
+			continue;
+
+		float plane = ray.Direction[a] > 0 ? max[a] + 1.0f : min[a];
+		float t = (plane - ray.Origin[a]) * ray.InvDirection[a];
+		if (t < tmax)
+		{
+			tmax = t;
+			axis = a;
+		}
+	}
+
+	return tmax;
+}
+
 float Octree::ray_intersect_box(const u_shortV3& min, const u_shortV3& max, const Ray& ray)
 {
 	float tx1 = ray.InvDirection.x * (-ray.Origin.x + min.x);
@@ -994,8 +2112,71 @@ bool Octree::point_in_box(const u_shortV3& min, const u_shortV3& max, const glm:
 	return min.x <= p.x && p.x <= max.x && min.y <= p.y && p.y <= max.y && min.z <= p.z && p.z <= max.z;
 }
 
+uint8_t Octree::child_pos(uint16_t x, uint16_t y, uint16_t z, const u_shortV3& mid)
+{
+	// Same order as OctreeNode childs: Top | Left | Front
+	return (y <= mid.y ? 4 : 0) | (x > mid.x ? 2 : 0) | (z > mid.z ? 1 : 0);
+}
+
+uint8_t Octree::ray_child_pos(const u_shortV3& bottom_corner, const u_shortV3& top_corner, const Ray& ray, float t)
+{
+	bool high[3] = { false, false, false };
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		// Flat axes only have the low child
+		if (bottom_corner[a] == top_corner[a])
+			continue;
+
+		float plane = (uint16_t)((bottom_corner[a] + top_corner[a]) / 2.0f) + 1.0f;
+		if (ray.Direction[a] == 0)
+		{
+			high[a] = ray.Origin[a] >= plane;
+			continue;
+		}
+
+		// On the plane the ray is already past it when going up, not yet when going down
+		float t_mid = (plane - ray.Origin[a]) * ray.InvDirection[a];
+		high[a] = ray.Direction[a] > 0 ? t_mid <= t : t_mid > t;
+	}
+
+	return (high[1] ? 0 : 4) | (high[0] ? 2 : 0) | (high[2] ? 1 : 0);
+}
+
+void Octree::child_bounds(const u_shortV3& bottom_corner, const u_shortV3& top_corner, uint8_t pos, u_shortV3& child_bottom, u_shortV3& child_top)
+{
+	u_shortV3 mid = {
+		(uint16_t)((top_corner.x + bottom_corner.x) / 2.0f),
+		(uint16_t)((top_corner.y + bottom_corner.y) / 2.0f),
+		(uint16_t)((top_corner.z + bottom_corner.z) / 2.0f)
+	};
+
+	u_shortV3 bot = bottom_corner, top = top_corner;
+
+	if (pos & 2) bot.x = mid.x + 1;
+	else         top.x = mid.x;
+
+	if (pos & 4) top.y = mid.y;
+	else         bot.y = mid.y + 1;
+
+	if (pos & 1) bot.z = mid.z + 1;
+	else         top.z = mid.z;
+
+	child_bottom = bot;
+	child_top = top;
+}
+
 uint16_t Octree::find_node_data(uint16_t x, uint16_t y, uint16_t z)
 {
+	if (has_compact_nodes())
+		return find_compact_node_data(x, y, z);
+
+	if (m_Layout == OctreeLayout::Brickmap)
+	{
+		uint32_t data = 0;
+		m_Brickmap.find_voxel(x, y, z, data);
+		return data;
+	}
+
 	return find_node_data(x, y, z, &m_Nodes[0]);
 }
 
@@ -1004,7 +2185,39 @@ bool Octree::find_node(uint16_t x, uint16_t y, uint16_t z, OctreeNode*& result,
 	return find_node(x, y, z, &m_Nodes[0], result, max_depth);
 }
 
+bool Octree::find_node(uint16_t x, uint16_t y, uint16_t z, OctreeNodeRef& result, short& max_depth)
+{
+	if (has_compact_nodes())
+		return find_compact_node(x, y, z, result, max_depth);
+
+	// No LOD in the brickmap, always a single voxel
+	if (m_Layout == OctreeLayout::Brickmap)
+	{
+		result = { nullptr, u_shortV3{ x, y, z }, u_shortV3{ x, y, z }, 0, false, false };
+		result.has_data = m_Brickmap.find_voxel(x, y, z, result.data);
+		return result.has_data;
+	}
+
+	OctreeNode* node;
+	bool found = find_node(x, y, z, &m_Nodes[0], node, max_depth);
+
+	result = { node, node->bottom_corner, node->top_corner, node_data(node), node->has_data(), !node->is_full() && node->first_child != -1 };
+	return found;
+}
+
 bool Octree::ray_travel(const Ray& ray, RayHit* hit)
 {
+	if (m_Layout == OctreeLayout::Brickmap)
+	{
+		if (!m_Brickmap.ray_travel(ray, hit))
+			return false;
+
+		hit->Surface = resolve_material(hit->Data, false);
+		return true;
+	}
+
+	if (m_Traversal == OctreeTraversal::Parametric)
+		return proc_ray_travel_parametric(ray, hit);
+
 	return proc_ray_travel(ray, &m_Nodes[0], hit);
 }
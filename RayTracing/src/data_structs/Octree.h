@@ -1,9 +1,14 @@
 #pragma once
 
 #include "../Ray.h"
+#include "../Material.h"
+#include "../utils/MappedFile.h"
+#include "Brickmap.h"
 
 #include <vector>
 #include <queue>
+#include <string>
+#include <unordered_map>
 
 // 6 bytes | 48 bit
 struct u_shortV3
@@ -19,7 +24,7 @@ struct u_shortV3
 	u_shortV3(uint16_t x_, uint16_t y_, uint16_t z_)
 		: x(x_), y(y_), z(z_) {}
 
-	uint16_t max()
+	uint16_t max() const
 	{
 		if (x > y)
 			if (x > z) return x;
@@ -29,6 +34,11 @@ struct u_shortV3
 			else       return z;
 	}
 
+	uint16_t operator[](uint8_t i) const
+	{
+		return i == 0 ? x : (i == 1 ? y : z);
+	}
+
 	bool is_zero()
 	{
 		return x == 0 && y == 0 && z == 0;
@@ -84,6 +94,9 @@ struct OctreeNode
 
 	// 1b IsFull | 1b HasData | 2b ChildFormat | 28b Data
 	uint32_t flags;
+
+	// Uninitialized, for bulk loads that overwrite the whole array
+	OctreeNode() = default;
 	
 	OctreeNode(u_shortV3& bottom_corn, u_shortV3& top_corn, uint8_t i, uint8_t child_count)
 		: first_child(-1), flags(0)
@@ -269,27 +282,172 @@ struct OctreeNode
 	}
 };
 
+// .oct files store the node array as laid out in memory
+static_assert(sizeof(OctreeNode) == 20, "OctreeNode layout changed, bump the .oct version");
+
+// 8 bytes | 64 bit
+struct Voxel
+{
+	uint16_t x, y, z;
+	uint32_t data; // Material index, 0 is empty
+};
+
+// 8 bytes | 64 bit
+// Bounds are implicit, they are derived from the parent while descending.
+// Only children with data are stored, packed in TLF..BRB order after first_child.
+struct CompactOctreeNode
+{
+	// 24b FirstChild | 8b LeafMask
+	uint32_t child;
+
+	// 24b Data | 8b ValidMask
+	uint32_t data_mask;
+
+	CompactOctreeNode()
+		: child(0), data_mask(0) {}
+
+	uint32_t first_child() const
+	{
+		return child & 0x00FFFFFF;
+	}
+
+	uint8_t leaf_mask() const
+	{
+		return child >> 24;
+	}
+
+	uint32_t data() const
+	{
+		return data_mask & 0x00FFFFFF;
+	}
+
+	uint8_t valid_mask() const
+	{
+		return data_mask >> 24;
+	}
+
+	uint32_t child_index(uint8_t pos) const
+	{
+		return first_child() + popcount(valid_mask() & ((1 << pos) - 1));
+	}
+
+	static uint8_t popcount(uint8_t v)
+	{
+		v = v - ((v >> 1) & 0x55);
+		v = (v & 0x33) + ((v >> 2) & 0x33);
+		return (v + (v >> 4)) & 0x0F;
+	}
+};
+
+// Layout independent result of a point lookup
+struct OctreeNodeRef
+{
+	OctreeNode* node; // Standard layout only
+	u_shortV3 bottom_corner, top_corner;
+	uint32_t data;
+	bool has_data;
+	bool is_lod; // data is the averaged colour of an interior node
+};
+
+// Interior node on the parametric traversal stack, pos is the child the ray is in
+struct OctreeTraversalFrame
+{
+	uint32_t node; // m_Nodes or m_CompactNodes index
+	u_shortV3 bottom_corner, top_corner;
+	uint8_t pos;
+};
+
+enum class OctreeLayout : uint8_t
+{
+	Standard = 0, // OctreeNode, explicit bounds, editable
+	Compact,      // CompactOctreeNode, implicit bounds, read-only
+	DAG,          // CompactOctreeNode, identical subtrees shared, read-only
+	Brickmap      // Brickmap, flat 8^3 bricks for small dense models, read-only
+};
+
+enum class OctreeTraversal : uint8_t
+{
+	DDA = 0,   // Unit voxel steps, lookup from the root when leaving the cached node
+	Parametric // Descends into childs along the ray and steps over empty siblings, cost scales with depth instead of ray length
+};
+
 class Octree
 {
+public:
+	// Side of the distance field cells, in voxels
+	static constexpr uint8_t DISTANCE_BRICK = 4;
+
+	// Voxel data is a 16 bit index into m_Materials
+	static constexpr uint32_t MAX_MATERIALS = 1 << 16;
+
+	// 16 bit coordinates, a 65536 wide root halves 16 times down to a voxel
+	static constexpr uint8_t MAX_LEVELS = 17;
+
 public:
 	Octree();
 
 	void init(uint16_t size_x, uint16_t size_y, uint16_t size_z);
 
+	// Bulk build from a voxel list, emits an already collapsed tree.
+	// The root childs are built in parallel and spliced together.
+	void build(uint16_t size_x, uint16_t size_y, uint16_t size_z, const std::vector<Voxel>& voxels);
+
 	void add_node(uint32_t first_child, u_shortV3 bottom_corner, u_shortV3 top_corner, uint32_t flags);
 
 	void insert_node(uint16_t x, uint16_t y, uint16_t z, uint32_t data);
 	void insert_range_node(u_shortV3& min_bound, u_shortV3& max_bound, uint32_t data);
 
+	// Incremental edits, Standard layout only. Only the nodes overlapping the edit are
+	// touched: full nodes are split on demand, siblings are merged back and the LOD data
+	// is refreshed on the way up. Data 0 clears, freed child blocks are reused.
+	void set_voxel(uint16_t x, uint16_t y, uint16_t z, uint32_t data);
+	void clear_voxel(uint16_t x, uint16_t y, uint16_t z);
+	void fill_box(const u_shortV3& min_bound, const u_shortV3& max_bound, uint32_t data);
+
+	// Applies all edits in one depth first pass, only touched subtrees are merged
+	// and get their LOD data refreshed. Last edit wins on duplicates.
+	void apply_edits(const std::vector<Voxel>& edits);
+
 	void collapse_nodes();
 
+	// Volume weighted average colour and coverage of every interior node, built
+	// bottom-up in parallel. Kept up to date by the edits once built.
 	void build_lods();
 
+	bool has_lods() const { return m_LodColors.size() > 0; }
+
 	void calculate_max_depth();
 
+	// Child bounds derived from the root bounds, for node arrays stored without them
+	void calculate_bounds();
+
+	// Link every leaf face to its neighbour so traversal does not restart at the root.
+	// Standard layout only, edits drop the ropes.
+	void build_ropes();
+
+	bool has_ropes() const { return m_Layout == OctreeLayout::Standard && m_Ropes.size() == m_Nodes.size() * 6; }
+
+	// Chebyshev distance from every brick to the nearest non empty one, lets the DDA
+	// jump over empty space. Built from the Standard layout, kept across conversions,
+	// edits keep it conservative.
+	void build_distance_field();
+
+	bool has_distance_field() const { return m_Distances.size() > 0; }
+
+	// Convert the node storage, m_Nodes keeps only the root for its bounds.
+	// False when the conversion is not supported, the layout is left unchanged.
+	bool set_layout(OctreeLayout layout);
+
+	// Older dumps store the colour as voxel data, every distinct colour becomes a material
+	void index_colors();
+
+	// Every voxel of the Standard layout, full nodes are expanded
+	void collect_voxels(std::vector<Voxel>& voxels);
+
 	uint16_t find_node_data(uint16_t x, uint16_t y, uint16_t z);
 
 	bool find_node(uint16_t x, uint16_t y, uint16_t z, OctreeNode*& result, short& max_depth);
+	bool find_node(uint16_t x, uint16_t y, uint16_t z, OctreeNodeRef& result, short& max_depth);
 
 	bool ray_travel(const Ray& ray, RayHit* hit);
 
@@ -299,15 +457,50 @@ public:
 private:
 	void subdivide_node(OctreeNode*& mod_node, uint32_t& first_child);
 
-	std::vector<std::pair<uint32_t, std::deque<uint32_t>>> check_collapse_path(uint32_t node_idx);
+	void edit_box(uint32_t node_idx, const u_shortV3& min_bound, const u_shortV3& max_bound, uint32_t data, uint8_t depth);
+
+	void edit_voxels(uint32_t node_idx, const std::vector<std::pair<uint64_t, uint32_t>>& keys, const std::vector<Voxel>& edits,
+		uint32_t start, uint32_t end, uint8_t shift, uint8_t depth);
+
+	void set_leaf(uint32_t node_idx, uint32_t data, uint8_t depth);
+
+	void split_node(uint32_t node_idx, uint8_t depth);
+
+	void merge_childs(uint32_t node_idx);
+
+	uint32_t alloc_childs(uint32_t node_idx);
+
+	void free_childs(uint32_t node_idx);
+
+	void fill_distance_field(const u_shortV3& min_bound, const u_shortV3& max_bound);
+
+	void relax_distance_field(const int from[3], const int to[3]);
+
+	uint64_t morton_key(uint16_t x, uint16_t y, uint16_t z, uint8_t levels);
+
+	static void build_node(std::vector<OctreeNode>& nodes, uint32_t node_idx, const std::vector<std::pair<uint64_t, uint32_t>>& keys,
+		const std::vector<Voxel>& voxels, uint32_t start, uint32_t end, uint8_t shift);
+
+	bool collapse_node(uint32_t node_idx);
 
-	std::vector<uint32_t> collapse(uint32_t& node_idx);
+	void compact_nodes();
 
-	std::tuple<bool, uint32_t, std::vector<uint32_t>> check_recursively_equal_childs(OctreeNode* node);
+	void calculate_node_lod(uint32_t node_idx);
 
-	void remove_nodes(std::vector<uint32_t>& sub_nodes);
+	void calculate_node_bounds(uint32_t node_idx);
 
-	uint32_t calculate_node_lod(OctreeNode* node);
+	void set_childs_bounds(uint32_t node_idx);
+
+	uint32_t average_childs_lod(uint32_t node_idx);
+
+	uint32_t child_lod(uint32_t node_idx);
+
+	uint32_t node_data(OctreeNode* node);
+
+	// Occupancy of a LOD stop, kept apart from the colour so black averages are not holes
+	uint8_t node_coverage(OctreeNode* node);
+
+	Material resolve_material(uint32_t data, bool is_lod) const;
 
 	uint8_t find_max_depth(OctreeNode* node);
 
@@ -315,12 +508,98 @@ private:
 
 	bool find_node(uint16_t x, uint16_t y, uint16_t z, OctreeNode* node, OctreeNode*& result, short& max_depth);
 
+	void build_compact_node(uint32_t node_idx, uint32_t compact_idx);
+
+	void collect_voxels(uint32_t node_idx, std::vector<Voxel>& voxels);
+
+	void mark_solid_bricks(uint32_t node_idx);
+
+	uint8_t empty_distance(const glm::vec3& pos) const;
+
+	void build_dag();
+
+	CompactOctreeNode build_dag_node(uint32_t node_idx, const u_shortV3& bottom_corner, const u_shortV3& top_corner,
+		std::vector<CompactOctreeNode>& dag_nodes, std::unordered_map<std::string, uint32_t>& blocks);
+
+	bool has_compact_nodes() const { return m_Layout == OctreeLayout::Compact || m_Layout == OctreeLayout::DAG; }
+
+	uint32_t find_rope_node(const u_shortV3& bottom_corner, const u_shortV3& top_corner);
+
+	bool find_node_by_rope(uint16_t x, uint16_t y, uint16_t z, OctreeNode* leaf, uint8_t face, OctreeNodeRef& result);
+
+	uint16_t find_compact_node_data(uint16_t x, uint16_t y, uint16_t z);
+
+	bool find_compact_node(uint16_t x, uint16_t y, uint16_t z, OctreeNodeRef& result, short& max_depth);
+
 	bool proc_ray_travel(const Ray& ray, OctreeNode* node, RayHit* hit);
 
+	bool proc_ray_travel_parametric(const Ray& ray, RayHit* hit);
+
+	static float ray_exit_box(const u_shortV3& min, const u_shortV3& max, const Ray& ray, uint8_t& axis);
+	static float ray_exit_box(const glm::vec3& min, const glm::vec3& max, const Ray& ray, uint8_t& axis);
+
 	static bool point_in_box(const u_shortV3& min, const u_shortV3& max, const glm::vec3& p);
 
+	static uint8_t child_pos(uint16_t x, uint16_t y, uint16_t z, const u_shortV3& mid);
+
+	// Child the ray is in at t, from the t of the mid planes instead of the rounded position
+	static uint8_t ray_child_pos(const u_shortV3& bottom_corner, const u_shortV3& top_corner, const Ray& ray, float t);
+
+	static void child_bounds(const u_shortV3& bottom_corner, const u_shortV3& top_corner, uint8_t pos, u_shortV3& child_bottom, u_shortV3& child_top);
+
 public:
-	glm::vec3 m_Position;
 	uint8_t m_MaxDepth;
-	std::vector<OctreeNode> m_Nodes;
+	OctreeLayout m_Layout;
+	OctreeTraversal m_Traversal;
+	// Owned, or a view into a mapped .oct file for read-only assets
+	MappedArray<OctreeNode> m_Nodes;
+	std::vector<CompactOctreeNode> m_CompactNodes;
+
+	// Unused child blocks left by edits, one list per child format (8, 4, 2 childs)
+	std::vector<uint32_t> m_FreeBlocks[3];
+	Brickmap m_Brickmap;
+
+	// Indexed by the voxel data, changing one is O(1) and only the LOD colours need a rebuild
+	std::vector<Material> m_Materials;
+
+	// 8b Coverage | 24b Colour per node, only read for interior nodes
+	MappedArray<uint32_t> m_LodColors;
+
+	// 6 per node (-X, +X, -Y, +Y, -Z, +Z), -1 on the octree boundary
+	MappedArray<uint32_t> m_Ropes;
+
+	// One per DISTANCE_BRICK^3 brick, 0 for bricks with data
+	std::vector<uint8_t> m_Distances;
+	u_shortV3 m_DistanceGrid;
+};
+
+// Records voxel edits and applies them together on commit, so explosions or
+// stamping cost one pass over the touched region instead of one per edit
+class OctreeEditBatch
+{
+public:
+	OctreeEditBatch(Octree& octree)
+		: m_Octree(octree) {}
+
+	void set_voxel(uint16_t x, uint16_t y, uint16_t z, uint32_t data)
+	{
+		m_Edits.push_back({ x, y, z, data & 0x0FFFFFFF });
+	}
+
+	void clear_voxel(uint16_t x, uint16_t y, uint16_t z)
+	{
+		m_Edits.push_back({ x, y, z, 0 });
+	}
+
+	size_t size() const { return m_Edits.size(); }
+
+	void commit()
+	{
+		m_Octree.apply_edits(m_Edits);
+		m_Edits.clear();
+	}
+
+private:
+	Octree& m_Octree;
+	std::vector<Voxel> m_Edits;
 };
@@ -0,0 +1,259 @@
+#include "Tree64.h"
+
+#include "Octree.h"
+
+#include "Walnut/Timer.h"
+
+#include "../utils/Utils.h"
+
+#include "../Core.h"
+
+#include <iostream>
+
+Tree64::Tree64()
+	: m_Size(0), m_Levels(1) {}
+
+void Tree64::build(uint16_t size_x, uint16_t size_y, uint16_t size_z, const std::vector<Voxel>& voxels)
+{
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
+
+	m_Size = glm::ivec3(size_x, size_y, size_z);
+
+	m_Levels = 1;
+	uint32_t max_size = std::max(size_x, std::max(size_y, size_z));
+	while ((1u << (2 * m_Levels)) < max_size)
+		m_Levels++;
+
+	m_Nodes.clear();
+	m_MaterialIds.clear();
+	m_Nodes.emplace_back();
+
+	if (voxels.size() == 0)
+		return;
+
+	// Sort by the 6 bit child digits, from the root down
+	std::vector<std::pair<uint64_t, uint32_t>> keys(voxels.size());
+	for (uint32_t i = 0; i < voxels.size(); i++)
+		keys[i] = { tree_key(voxels[i].x, voxels[i].y, voxels[i].z), i };
+
+	Utils::RadixSort(keys, 6 * m_Levels);
+
+	m_MaterialIds.reserve(voxels.size());
+	build_node(0, keys, voxels, 0, (uint32_t) keys.size(), 6 * (m_Levels - 1));
+
+	m_Nodes.shrink_to_fit();
+
+	LOG("Build Tree64: " << m_Nodes.size() << " nodes " << (int) m_Levels << " levels " << ((m_Nodes.size() * sizeof(Tree64Node) + m_MaterialIds.size() * sizeof(uint16_t)) / 1024.0f) << " KB in " << t.ElapsedMillis() << "ms");
+}
+
+void Tree64::build(Octree& octree)
+{
+	std::vector<Voxel> voxels;
+	octree.collect_voxels(voxels);
+
+	const u_shortV3& size = octree.m_Nodes[0].top_corner;
+	build(size.x + 1, size.y + 1, size.z + 1, voxels);
+}
+
+bool Tree64::find_voxel(uint16_t x, uint16_t y, uint16_t z, uint32_t& data) const
+{
+	if (x >= m_Size.x || y >= m_Size.y || z >= m_Size.z)
+		return false;
+
+	const Tree64Node* node = &m_Nodes[0];
+	for (uint8_t level = 0; level < m_Levels; level++)
+	{
+		uint8_t shift = cell_shift(level);
+		uint8_t bit = ((x >> shift) & 3) | (((y >> shift) & 3) << 2) | (((z >> shift) & 3) << 4);
+		if ((node->child_mask & (1ull << bit)) == 0)
+			return false;
+
+		if (node->is_leaf())
+		{
+			data = m_MaterialIds[node->child_index(bit)];
+			return true;
+		}
+
+		node = &m_Nodes[node->child_index(bit)];
+	}
+
+	return false;
+}
+
+uint64_t Tree64::tree_key(uint16_t x, uint16_t y, uint16_t z) const
+{
+	uint64_t key = 0;
+	for (uint8_t level = 0; level < m_Levels; level++)
+	{
+		uint8_t shift = cell_shift(level);
+		key = (key << 6) | ((x >> shift) & 3) | (((y >> shift) & 3) << 2) | (((z >> shift) & 3) << 4);
+	}
+
+	return key;
+}
+
+void Tree64::build_node(uint32_t node_idx, const std::vector<std::pair<uint64_t, uint32_t>>& keys, const std::vector<Voxel>& voxels,
+	uint32_t start, uint32_t end, uint8_t shift)
+{
+	uint64_t child_mask = 0;
+	for (uint32_t i = start; i < end; i++)
+		child_mask |= 1ull << ((keys[i].first >> shift) & 63);
+
+	m_Nodes[node_idx].child_mask = child_mask;
+
+	// Last level, the childs are voxels already in bit order
+	if (shift == 0)
+	{
+		m_Nodes[node_idx].child = 0x80000000 | (uint32_t) m_MaterialIds.size();
+		for (uint32_t i = start; i < end; i++)
+			m_MaterialIds.push_back((uint16_t) voxels[keys[i].second].data);
+		return;
+	}
+
+	uint32_t first_child = (uint32_t) m_Nodes.size();
+	m_Nodes[node_idx].child = first_child;
+	m_Nodes.resize(first_child + Tree64Node::popcount(child_mask));
+
+	// Every run of equal digits is one child
+	uint32_t child = first_child;
+	for (uint32_t i = start; i < end;)
+	{
+		uint64_t digit = (keys[i].first >> shift) & 63;
+
+		uint32_t j = i + 1;
+		while (j < end && ((keys[j].first >> shift) & 63) == digit)
+			j++;
+
+		build_node(child++, keys, voxels, i, j, shift - 6);
+		i = j;
+	}
+}
+
+bool Tree64::ray_travel(const Ray& ray, RayHit* hit) const
+{
+	hit->Position = {};
+	hit->Node = nullptr;
+	hit->Data = 0;
+	hit->Normal = {};
+
+	if (m_Nodes[0].child_mask == 0)
+		return false;
+
+	// Clip against the volume, remember the entry face
+	float t_enter = 0, t_exit = FLT_MAX;
+	int enter_axis = -1;
+	for (uint8_t a = 0; a < 3; a++)
+	{
+		if (ray.Direction[a] == 0)
+		{
+			if (ray.Origin[a] < 0 || ray.Origin[a] >= m_Size[a])
+				return false;
+			continue;
+		}
+
+		float t0 = -ray.Origin[a] * ray.InvDirection[a];
+		float t1 = (m_Size[a] - ray.Origin[a]) * ray.InvDirection[a];
+		if (t0 > t1)
+			std::swap(t0, t1);
+
+		if (t0 > t_enter)
+		{
+			t_enter = t0;
+			enter_axis = a;
+		}
+		t_exit = std::min(t_exit, t1);
+	}
+
+	if (t_enter >= t_exit || t_enter > ray.MaxDistance)
+		return false;
+
+	glm::vec3 norm{};
+	if (enter_axis != -1)
+		norm[enter_axis] = -glm::sign(ray.Direction[enter_axis]);
+	else
+	{
+		// Starting inside, face the major axis
+		glm::vec3 dir = glm::abs(ray.Direction);
+		uint8_t axis = dir.x >= dir.y && dir.x >= dir.z ? 0 : (dir.y >= dir.z ? 1 : 2);
+		norm[axis] = -glm::sign(ray.Direction[axis]);
+	}
+
+	float t = t_enter;
+	glm::ivec3 pos = glm::clamp(glm::ivec3(glm::floor(ray.Origin + ray.Direction * t)), glm::ivec3(0), m_Size - 1);
+
+	// Node of every level on the path to pos
+	uint32_t stack[8];
+	stack[0] = 0;
+	uint8_t level = 0;
+
+	while (t < ray.MaxDistance)
+	{
+		const Tree64Node& node = m_Nodes[stack[level]];
+		uint8_t shift = cell_shift(level);
+		uint8_t bit = ((pos.x >> shift) & 3) | (((pos.y >> shift) & 3) << 2) | (((pos.z >> shift) & 3) << 4);
+
+		if (node.child_mask & (1ull << bit))
+		{
+			if (node.is_leaf())
+			{
+				hit->Position = glm::vec3(pos.x, pos.y, pos.z);
+				hit->Data = m_MaterialIds[node.child_index(bit)];
+				hit->Normal = norm;
+				hit->Distance = t;
+				return true;
+			}
+
+			stack[++level] = node.child_index(bit);
+			continue;
+		}
+
+		// Skip the whole empty child cell
+		int cell_size = 1 << shift;
+		glm::ivec3 cell_min = glm::ivec3(pos.x >> shift << shift, pos.y >> shift << shift, pos.z >> shift << shift);
+
+		uint8_t axis = 0;
+		float t_cell = FLT_MAX;
+		for (uint8_t a = 0; a < 3; a++)
+		{
+			if (ray.Direction[a] == 0)
+				continue;
+
+			float plane = (float) (ray.Direction[a] > 0 ? cell_min[a] + cell_size : cell_min[a]);
+			float t_a = (plane - ray.Origin[a]) * ray.InvDirection[a];
+			if (t_a < t_cell)
+			{
+				t_cell = t_a;
+				axis = a;
+			}
+		}
+
+		t = std::max(t, t_cell);
+		if (t > t_exit)
+			break;
+
+		glm::ivec3 next = glm::ivec3(glm::floor(ray.Origin + ray.Direction * t));
+		next[axis] = ray.Direction[axis] > 0 ? cell_min[axis] + cell_size : cell_min[axis] - 1;
+
+		// Other axes can round outside the cell on grazing rays
+		for (uint8_t a = 0; a < 3; a++)
+			if (a != axis)
+				next[a] = std::min(std::max(next[a], cell_min[a]), cell_min[a] + cell_size - 1);
+
+		if (next[axis] < 0 || next[axis] >= m_Size[axis])
+			break;
+
+		norm = glm::vec3(0);
+		norm[axis] = -glm::sign(ray.Direction[axis]);
+
+		// Pop to the first node that still contains next
+		uint32_t diff = (pos.x ^ next.x) | (pos.y ^ next.y) | (pos.z ^ next.z);
+		while (level > 0 && (diff >> (cell_shift(level) + 2)) != 0)
+			level--;
+
+		pos = next;
+	}
+
+	return false;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "../Ray.h"
+
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+struct Voxel;
+class Octree;
+
+// 16 bytes | 128 bit
+// 4x4x4 childs, bit x + y * 4 + z * 16 of child_mask is set for non empty childs.
+// Childs are packed in bit order after first_child, in m_MaterialIds for leaf nodes.
+struct Tree64Node
+{
+	uint64_t child_mask;
+
+	// 1b IsLeaf | 31b FirstChild
+	uint32_t child;
+
+	uint32_t pad; // ensure 16 byte total size
+
+	Tree64Node()
+		: child_mask(0), child(0), pad(0) {}
+
+	bool is_leaf() const
+	{
+		return (child & 0x80000000) == 0x80000000;
+	}
+
+	uint32_t first_child() const
+	{
+		return child & 0x7FFFFFFF;
+	}
+
+	uint32_t child_index(uint8_t bit) const
+	{
+		return first_child() + popcount(child_mask & ((1ull << bit) - 1));
+	}
+
+	static uint8_t popcount(uint64_t v)
+	{
+#ifdef _MSC_VER
+		return (uint8_t) __popcnt64(v);
+#else
+		return (uint8_t) __builtin_popcountll(v);
+#endif
+	}
+};
+
+// 64-ary tree, half the levels of the octree for the same volume
+class Tree64
+{
+public:
+	Tree64();
+
+	void build(uint16_t size_x, uint16_t size_y, uint16_t size_z, const std::vector<Voxel>& voxels);
+
+	// Standard layout only
+	void build(Octree& octree);
+
+	bool find_voxel(uint16_t x, uint16_t y, uint16_t z, uint32_t& data) const;
+
+	bool ray_travel(const Ray& ray, RayHit* hit) const;
+
+private:
+	uint64_t tree_key(uint16_t x, uint16_t y, uint16_t z) const;
+
+	void build_node(uint32_t node_idx, const std::vector<std::pair<uint64_t, uint32_t>>& keys, const std::vector<Voxel>& voxels,
+		uint32_t start, uint32_t end, uint8_t shift);
+
+	// Childs of a node at level are 4^(levels - 1 - level) voxels wide
+	uint8_t cell_shift(uint8_t level) const { return 2 * (m_Levels - 1 - level); }
+
+public:
+	glm::ivec3 m_Size;
+	uint8_t m_Levels;
+	std::vector<Tree64Node> m_Nodes;
+	std::vector<uint16_t> m_MaterialIds;
+};
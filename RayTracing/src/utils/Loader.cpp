@@ -2,9 +2,14 @@
 
 #include "Walnut/Timer.h"
 
+#include "Utils.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+
 #include "../Core.h"
 
 #include <iostream>
+#include <cstring>
 
 const uint32_t Loader::PALETTE[256] = {
 	0x00000000, 0xffffffff, 0xffccffff, 0xff99ffff, 0xff66ffff, 0xff33ffff, 0xff00ffff, 0xffffccff, 0xffccccff, 0xff99ccff, 0xff66ccff, 0xff33ccff, 0xff00ccff, 0xffff99ff, 0xffcc99ff, 0xff9999ff,
@@ -46,16 +51,21 @@ Octree* Loader::load_vox(const char* file_name, std::vector<Octree>& octrees)
 
 	Octree& octree = octrees.emplace_back();
 
-	load_chunk(file, octree);
+	u_shortV3 size;
+	std::vector<Voxel> voxels;
+	load_chunk(file, size, voxels);
 
 	file.close();
 
+	octree.build(size.x, size.y, size.z, voxels);
+	load_palette(octree.m_Materials);
+
 	float load_vox = t.ElapsedMillis();
 	LOG("Load Vox '" << file_name << "': " << load_vox << "ms");
 
-	octree.collapse_nodes();
 	octree.build_lods();
 	octree.calculate_max_depth();
+	octree.build_distance_field();
 
 	LOG("Post-Load Vox '" << file_name << "': " << (t.ElapsedMillis() - load_vox) << "ms");
 
@@ -76,6 +86,38 @@ Octree* Loader::load_vox(const char* file_name, std::vector<Octree>& octrees)
 	return &octree;
 }
 
+bool Loader::load_vox(const char* file_name, Tree64& tree)
+{
+	std::fstream file(file_name, std::ios::binary | std::ios::in);
+	if (!file.is_open())
+	{
+		std::cout << "ERROR Open File: " << file_name << std::endl;
+		return false;
+	}
+
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
+
+	char version_id[4];
+	int version;
+
+	file.read((char*) &version_id, sizeof(version_id));
+	file.read((char*) &version, sizeof(version));
+
+	u_shortV3 size;
+	std::vector<Voxel> voxels;
+	load_chunk(file, size, voxels);
+
+	file.close();
+
+	tree.build(size.x, size.y, size.z, voxels);
+
+	LOG("Load Vox Tree64 '" << file_name << "': " << t.ElapsedMillis() << "ms");
+
+	return true;
+}
+
 Octree* Loader::load_oct(const char* file_name, std::vector<Octree>& octrees)
 {
 	// Check if .oct exist
@@ -92,31 +134,183 @@ Octree* Loader::load_oct(const char* file_name, std::vector<Octree>& octrees)
 #endif // RAY_DEBUG
 
 	std::fstream file(file_name, std::ios::binary | std::ios::in);
+	size_t file_size = (size_t) buffer.st_size;
 
-	// Read Nodes Size
-	int size;
-	file.read((char*) &size, sizeof(int));
+	OctHeader header{};
+	file.read((char*) &header, sizeof(OctHeader));
+
+	bool legacy = strncmp(header.magic, OCT_MAGIC, 4) != 0;
+	if (!legacy && header.version != OCT_VERSION)
+	{
+		std::cout << "Unsupported .oct version " << header.version << ": " << file_name << std::endl;
+		return nullptr;
+	}
 
 	Octree& octree = octrees.emplace_back();
 
-	// Read Nodes
-	for (int i = 0; i < size; i++)
+	if (legacy)
 	{
-		uint32_t first_child, flags;
-		u_shortV3 bottom_corner, top_corner;
-		
-		file.read((char*) &first_child, sizeof(uint32_t));
+		file.clear();
+		file.seekg(0);
+		if (!load_oct_nodes_v1(file, file_size, octree))
+		{
+			std::cout << "Truncated .oct: " << file_name << std::endl;
+			octrees.pop_back();
+			return nullptr;
+		}
+	}
+	else if (header.flags & OCT_COMPRESSED)
+	{
+		uint32_t block_count = 0;
+		file.read((char*) &block_count, sizeof(uint32_t));
+
+		// Counts and offsets come from the file, check them before sizing anything by them
+		size_t blocks_offset = sizeof(OctHeader) + sizeof(uint32_t) + sizeof(uint64_t) * ((size_t) block_count + 1);
+		if (!file || header.node_count == 0 || block_count != ((uint64_t) header.node_count + OCT_BLOCK_NODES - 1) / OCT_BLOCK_NODES ||
+			blocks_offset > file_size)
+		{
+			std::cout << "Corrupt .oct: " << file_name << std::endl;
+			octrees.pop_back();
+			return nullptr;
+		}
+
+		std::vector<uint64_t> offsets(block_count + 1);
+		file.read((char*) offsets.data(), sizeof(uint64_t) * (block_count + 1));
+
+		bool valid = (bool) file && offsets[0] == 0 && offsets[block_count] <= file_size - blocks_offset;
+		for (uint32_t b = 0; b < block_count && valid; b++)
+			valid = offsets[b] <= offsets[b + 1];
+
+		std::vector<uint8_t> blocks;
+		if (valid)
+		{
+			blocks.resize(offsets[block_count]);
+			valid = (bool) file.read((char*) blocks.data(), blocks.size());
+		}
+
+		if (valid)
+		{
+			octree.m_Nodes.resize(header.node_count);
+			if (header.flags & OCT_LODS)
+				octree.m_LodColors.resize(header.node_count);
+
+			std::atomic<bool> decoded(true);
+			ThreadPool::Get().ParallelFor(block_count, [&](uint32_t b) {
+				uint32_t end = std::min(header.node_count, (b + 1) * OCT_BLOCK_NODES);
+				if (!decode_oct_block(blocks.data() + offsets[b], blocks.data() + offsets[b + 1], octree, b * OCT_BLOCK_NODES, end, header.flags & OCT_LODS))
+					decoded = false;
+			});
+			valid = decoded;
+		}
+
+		if (!valid)
+		{
+			std::cout << "Corrupt .oct: " << file_name << std::endl;
+			octrees.pop_back();
+			return nullptr;
+		}
+
+		octree.m_Nodes[0].bottom_corner = u_shortV3{ 0 };
+		octree.m_Nodes[0].top_corner = u_shortV3{ (uint16_t)(header.size.x - 1), (uint16_t)(header.size.y - 1), (uint16_t)(header.size.z - 1) };
+		octree.calculate_bounds();
+
+		octree.m_MaxDepth = header.max_depth;
+	}
+	else
+	{
+		// The node count comes from the header, check it against the file before allocating
+		size_t arrays_size = (sizeof(OctreeNode) + (header.flags & OCT_LODS ? sizeof(uint32_t) : 0)) * (size_t) header.node_count;
+		bool valid = header.node_count > 0 && sizeof(OctHeader) + arrays_size <= file_size;
+
+		// One read straight into the node array, the flags are stored with their format
+		if (valid)
+		{
+			octree.m_Nodes.resize(header.node_count);
+			valid = (bool) file.read((char*) octree.m_Nodes.data(), sizeof(OctreeNode) * header.node_count);
+		}
+
+		if (valid && (header.flags & OCT_LODS))
+		{
+			octree.m_LodColors.resize(header.node_count);
+			valid = (bool) file.read((char*) octree.m_LodColors.data(), sizeof(uint32_t) * header.node_count);
+		}
+
+		if (!valid)
+		{
+			std::cout << "Truncated .oct: " << file_name << std::endl;
+			octrees.pop_back();
+			return nullptr;
+		}
+
+		octree.m_MaxDepth = header.max_depth;
+	}
 
-		file.read((char*) &bottom_corner.x, sizeof(uint16_t) * 3);
+	int size = (int) octree.m_Nodes.size();
 
-		file.read((char*) &top_corner.x, sizeof(uint16_t) * 3);
+	// Optional sections
+	char section_id[4];
+	while (file.read(section_id, sizeof(section_id)))
+	{
+		int section_size;
+		if (!file.read((char*) &section_size, sizeof(int)))
+			break;
+
+		size_t payload;
+		if (strncmp(section_id, "ROPE", 4) == 0)
+			payload = sizeof(uint32_t) * (size_t) section_size;
+		else if (strncmp(section_id, "MATL", 4) == 0)
+			payload = (size_t) section_size;
+		else if (strncmp(section_id, "DIST", 4) == 0)
+			payload = sizeof(uint16_t) * 3 + sizeof(uint8_t) * (size_t) section_size;
+		else
+			break;
+
+		// Same checks as map_oct, a section past the end is dropped and rebuilt
+		if (section_size < 0 || (size_t) file.tellg() + payload > file_size ||
+			(strncmp(section_id, "MATL", 4) == 0 && payload % sizeof(Material) != 0))
+		{
+			std::cout << "Corrupt .oct section '" << std::string(section_id, 4) << "': " << file_name << std::endl;
+			break;
+		}
+
+		if (strncmp(section_id, "ROPE", 4) == 0)
+		{
+			// Skip ropes built for another node count
+			if (section_size != size * 6)
+			{
+				file.seekg(payload, std::ios::cur);
+				continue;
+			}
+
+			octree.m_Ropes.resize(section_size);
+			file.read((char*) octree.m_Ropes.data(), payload);
+		}
+		else if (strncmp(section_id, "MATL", 4) == 0)
+		{
+			octree.m_Materials.resize(payload / sizeof(Material));
+			file.read((char*) octree.m_Materials.data(), payload);
+		}
+		else
+		{
+			file.read((char*) &octree.m_DistanceGrid.x, sizeof(uint16_t) * 3);
+
+			octree.m_Distances.resize(section_size);
+			file.read((char*) octree.m_Distances.data(), sizeof(uint8_t) * section_size);
+		}
+	}
 
-		file.read((char*) &flags, sizeof(uint32_t));
+	// Dumps without materials store the colours in the node data, the LOD colours stay the same
+	if (octree.m_Materials.size() == 0)
+		octree.index_colors();
 
-		octree.add_node(first_child, bottom_corner, top_corner, flags);
-	}
+	if (!octree.has_lods())
+		octree.build_lods();
 
-	octree.calculate_max_depth();
+	if (legacy)
+		octree.calculate_max_depth();
+
+	if (!octree.has_distance_field())
+		octree.build_distance_field();
 
 	file.close();
 
@@ -125,6 +319,120 @@ Octree* Loader::load_oct(const char* file_name, std::vector<Octree>& octrees)
 	return &octree;
 }
 
+Octree* Loader::map_oct(const char* file_name, std::vector<Octree>& octrees)
+{
+#ifdef RAY_DEBUG
+	Walnut::Timer t;
+#endif // RAY_DEBUG
+
+	std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(file_name);
+	if (!file->IsOpen())
+	{
+		std::cout << "File not found: " << file_name << std::endl;
+		return nullptr;
+	}
+
+	const uint8_t* data = file->GetData();
+	size_t file_size = file->GetSize();
+
+	OctHeader header{};
+	if (file_size >= sizeof(OctHeader))
+		memcpy(&header, data, sizeof(OctHeader));
+
+	if (strncmp(header.magic, OCT_MAGIC, 4) != 0 || header.version != OCT_VERSION)
+	{
+		std::cout << "Only .oct v" << OCT_VERSION << " files can be mapped: " << file_name << std::endl;
+		return nullptr;
+	}
+
+	// Compressed nodes have to be decoded into owned memory
+	if (header.flags & OCT_COMPRESSED)
+		return load_oct(file_name, octrees);
+
+	size_t offset = sizeof(OctHeader);
+	size_t arrays_size = (sizeof(OctreeNode) + (header.flags & OCT_LODS ? sizeof(uint32_t) : 0)) * header.node_count;
+	if (offset + arrays_size > file_size)
+	{
+		std::cout << "Truncated .oct: " << file_name << std::endl;
+		return nullptr;
+	}
+
+	Octree& octree = octrees.emplace_back();
+
+	// Nodes and LOD colours are traversed in place, nothing is read until a page is touched
+	octree.m_Nodes.view(file, offset, header.node_count);
+	offset += sizeof(OctreeNode) * header.node_count;
+
+	octree.m_MaxDepth = header.max_depth;
+
+	if (header.flags & OCT_LODS)
+	{
+		octree.m_LodColors.view(file, offset, header.node_count);
+		offset += sizeof(uint32_t) * header.node_count;
+	}
+
+	// Optional sections, written in this order so the ropes stay 4 byte aligned
+	while (offset + 8 <= file_size)
+	{
+		const char* section_id = (const char*) data + offset;
+
+		int section_size;
+		memcpy(&section_size, data + offset + 4, sizeof(int));
+		offset += 8;
+
+		size_t payload;
+		if (strncmp(section_id, "ROPE", 4) == 0)
+			payload = sizeof(uint32_t) * (size_t) section_size;
+		else if (strncmp(section_id, "MATL", 4) == 0)
+			payload = (size_t) section_size;
+		else if (strncmp(section_id, "DIST", 4) == 0)
+			payload = sizeof(uint16_t) * 3 + sizeof(uint8_t) * (size_t) section_size;
+		else
+			break;
+
+		// Everything is read straight from the mapping, a section past its end is dropped and rebuilt.
+		// Materials written with another layout do not split into whole Materials.
+		if (section_size < 0 || offset + payload > file_size ||
+			(strncmp(section_id, "MATL", 4) == 0 && payload % sizeof(Material) != 0))
+		{
+			std::cout << "Corrupt .oct section '" << std::string(section_id, 4) << "': " << file_name << std::endl;
+			break;
+		}
+
+		if (strncmp(section_id, "ROPE", 4) == 0)
+		{
+			if (section_size == header.node_count * 6)
+				octree.m_Ropes.view(file, offset, section_size);
+		}
+		else if (strncmp(section_id, "MATL", 4) == 0)
+		{
+			const Material* materials = (const Material*) (data + offset);
+			octree.m_Materials.assign(materials, materials + payload / sizeof(Material));
+		}
+		else
+		{
+			memcpy(&octree.m_DistanceGrid.x, data + offset, sizeof(uint16_t) * 3);
+			octree.m_Distances.assign(data + offset + sizeof(uint16_t) * 3, data + offset + payload);
+		}
+
+		offset += payload;
+	}
+
+	// v2 dumps carry all of these, filling one in copies the pages it writes
+	if (octree.m_Materials.size() == 0)
+		octree.index_colors();
+
+	if (!octree.has_lods())
+		octree.build_lods();
+
+	if (!octree.has_distance_field())
+		octree.build_distance_field();
+
+	LOG("Map Oct '" << file_name << "': " << t.ElapsedMillis() << " ms " << (file_size / 1024.0f / 1024) << " MB mapped");
+
+	return &octree;
+}
+
 void Loader::load_scene(const char* file_name, Camera& camera, bool& render_light, bool& render_normal)
 {
 #ifdef RAY_DEBUG
@@ -155,7 +463,7 @@ void Loader::load_scene(const char* file_name, Camera& camera, bool& render_ligh
 	LOG("Load Scene '" << file_name << "': " << t.ElapsedMillis() << "ms");
 }
 
-void Loader::dump_oct(const char* file_name, Octree& octree)
+void Loader::dump_oct(const char* file_name, Octree& octree, bool compressed)
 {
 #ifdef RAY_DEBUG
 	Walnut::Timer t;
@@ -163,20 +471,75 @@ void Loader::dump_oct(const char* file_name, Octree& octree)
 
 	std::fstream file(file_name, std::ios::binary | std::ios::out);
 
-	// Write Nodes Size
-	int size = octree.m_Nodes.size();
-	file.write((char*) &size, sizeof(int));
+	// Write Header
+	OctHeader header{};
+	memcpy(header.magic, OCT_MAGIC, 4);
+	header.version = OCT_VERSION;
+	header.node_count = (uint32_t) octree.m_Nodes.size();
+	header.size = { (uint16_t)(octree.m_Nodes[0].top_corner.x + 1), (uint16_t)(octree.m_Nodes[0].top_corner.y + 1), (uint16_t)(octree.m_Nodes[0].top_corner.z + 1) };
+	header.max_depth = octree.m_MaxDepth;
+	header.flags = (octree.has_lods() ? OCT_LODS : 0) | (compressed ? OCT_COMPRESSED : 0);
+	file.write((char*) &header, sizeof(OctHeader));
+
+	if (compressed)
+	{
+		uint32_t block_count = (header.node_count + OCT_BLOCK_NODES - 1) / OCT_BLOCK_NODES;
+
+		std::vector<std::vector<uint8_t>> blocks(block_count);
+		ThreadPool::Get().ParallelFor(block_count, [&](uint32_t b) {
+			uint32_t end = std::min(header.node_count, (b + 1) * OCT_BLOCK_NODES);
+			encode_oct_block(octree, b * OCT_BLOCK_NODES, end, blocks[b]);
+		});
+
+		// Block offsets first, so the loader can hand every block to its own task
+		std::vector<uint64_t> offsets(block_count + 1, 0);
+		for (uint32_t b = 0; b < block_count; b++)
+			offsets[b + 1] = offsets[b] + blocks[b].size();
+
+		file.write((char*) &block_count, sizeof(uint32_t));
+		file.write((char*) offsets.data(), sizeof(uint64_t) * (block_count + 1));
+		for (std::vector<uint8_t>& block : blocks)
+			file.write((char*) block.data(), block.size());
+	}
+	else
+	{
+		// Write Nodes
+		file.write((char*) octree.m_Nodes.data(), sizeof(OctreeNode) * header.node_count);
+
+		// Write LOD Colours
+		if (octree.has_lods())
+			file.write((char*) octree.m_LodColors.data(), sizeof(uint32_t) * header.node_count);
+	}
+
+	// Write Ropes, compressed files leave them to build_ropes as they would outweigh the nodes
+	if (octree.has_ropes() && !compressed)
+	{
+		file.write("ROPE", 4);
+
+		int ropes_size = octree.m_Ropes.size();
+		file.write((char*) &ropes_size, sizeof(int));
+		file.write((char*) octree.m_Ropes.data(), sizeof(uint32_t) * ropes_size);
+	}
 
-	// Write Nodes
-	for (OctreeNode& node : octree.m_Nodes)
+	// Write Materials
+	if (octree.m_Materials.size() > 0)
 	{
-		file.write((char*) &node.first_child, sizeof(uint32_t));
+		file.write("MATL", 4);
 
-		file.write((char*) &node.bottom_corner.x, sizeof(uint16_t) * 3);
+		int materials_size = sizeof(Material) * octree.m_Materials.size();
+		file.write((char*) &materials_size, sizeof(int));
+		file.write((char*) octree.m_Materials.data(), materials_size);
+	}
 
-		file.write((char*) &node.top_corner.x, sizeof(uint16_t) * 3);
+	// Write Distance Field
+	if (octree.has_distance_field())
+	{
+		file.write("DIST", 4);
 
-		file.write((char*) &node.flags, sizeof(uint32_t));
+		int distances_size = octree.m_Distances.size();
+		file.write((char*) &distances_size, sizeof(int));
+		file.write((char*) &octree.m_DistanceGrid.x, sizeof(uint16_t) * 3);
+		file.write((char*) octree.m_Distances.data(), sizeof(uint8_t) * distances_size);
 	}
 
 	file.close();
@@ -213,7 +576,179 @@ void Loader::dump_scene(const char* file_name, Camera& camera, bool& render_ligh
 	LOG("Dumping Scene: " << t.ElapsedMillis());
 }
 
-void Loader::load_chunk(std::fstream& file, Octree& octree)
+bool Loader::load_oct_nodes_v1(std::fstream& file, size_t file_size, Octree& octree)
+{
+	// Read Nodes Size
+	int size;
+	if (!file.read((char*) &size, sizeof(int)) || size <= 0 || sizeof(int) + (size_t) size * sizeof(OctreeNode) > file_size)
+		return false;
+
+	// Read Nodes
+	for (int i = 0; i < size; i++)
+	{
+		uint32_t first_child, flags;
+		u_shortV3 bottom_corner, top_corner;
+		
+		file.read((char*) &first_child, sizeof(uint32_t));
+
+		file.read((char*) &bottom_corner.x, sizeof(uint16_t) * 3);
+
+		file.read((char*) &top_corner.x, sizeof(uint16_t) * 3);
+
+		file.read((char*) &flags, sizeof(uint32_t));
+
+		octree.add_node(first_child, bottom_corner, top_corner, flags);
+	}
+
+	return (bool) file;
+}
+
+// LEB128, 7 bits per byte
+static void write_varint(std::vector<uint8_t>& out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((uint8_t) value);
+}
+
+static bool read_varint(const uint8_t*& in, const uint8_t* end, uint64_t& value)
+{
+	value = 0;
+	for (uint8_t shift = 0; shift < 64 && in < end; shift += 7)
+	{
+		uint8_t byte = *in++;
+		value |= (uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+// Tag byte of a compressed node:
+// 1b ChildPredicted | 2b DataMode | 2b ChildFormat | 1b HasData | 1b IsFull | 1b HasChilds
+enum OctDataMode : uint8_t
+{
+	OCT_DATA_ZERO = 0,
+	OCT_DATA_REPEAT, // Same as the last non zero data of the block
+	OCT_DATA_VARINT
+};
+
+void Loader::encode_oct_block(Octree& octree, uint32_t start, uint32_t end, std::vector<uint8_t>& block)
+{
+	block.reserve((end - start) * 2);
+
+	// Child blocks are allocated in order, the next first_child is usually right after the last one
+	uint64_t next_child = 0;
+	uint32_t last_data = 0;
+
+	for (uint32_t i = start; i < end; i++)
+	{
+		OctreeNode& node = octree.m_Nodes[i];
+		bool has_childs = node.first_child != -1;
+		uint32_t data = node.data();
+
+		uint8_t mode = data == 0 ? OCT_DATA_ZERO : (data == last_data ? OCT_DATA_REPEAT : OCT_DATA_VARINT);
+		bool predicted = has_childs && node.first_child == next_child;
+
+		block.push_back((uint8_t)(has_childs | (node.is_full() << 1) | (node.has_data() << 2) | (node.child_format() << 3) | (mode << 5) | (predicted << 7)));
+
+		if (has_childs)
+		{
+			// Zigzag, child blocks reused by edits can sit before the prediction
+			if (!predicted)
+			{
+				int64_t delta = (int64_t) node.first_child - (int64_t) next_child;
+				write_varint(block, (uint64_t)((delta << 1) ^ (delta >> 63)));
+			}
+			next_child = (uint64_t) node.first_child + node.child_count();
+		}
+
+		if (mode == OCT_DATA_VARINT)
+		{
+			write_varint(block, data);
+			last_data = data;
+		}
+
+		// LOD colours are only read for interior nodes
+		if (has_childs && octree.has_lods())
+		{
+			uint32_t lod = octree.m_LodColors[i];
+			block.insert(block.end(), (uint8_t*) &lod, (uint8_t*) &lod + sizeof(uint32_t));
+		}
+	}
+}
+
+bool Loader::decode_oct_block(const uint8_t* block, const uint8_t* block_end, Octree& octree, uint32_t start, uint32_t end, bool has_lods)
+{
+	uint64_t next_child = 0;
+	uint32_t last_data = 0;
+
+	for (uint32_t i = start; i < end; i++)
+	{
+		if (block >= block_end)
+			return false;
+
+		uint8_t tag = *block++;
+		bool has_childs = tag & 1;
+		uint8_t mode = (tag >> 5) & 0x3;
+
+		OctreeNode& node = octree.m_Nodes[i];
+		node.first_child = -1;
+
+		if (has_childs)
+		{
+			if ((tag & 0x80) == 0)
+			{
+				uint64_t zigzag;
+				if (!read_varint(block, block_end, zigzag))
+					return false;
+				next_child += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+			}
+			node.first_child = (uint32_t) next_child;
+		}
+
+		if (mode == OCT_DATA_VARINT)
+		{
+			uint64_t data;
+			if (!read_varint(block, block_end, data))
+				return false;
+			last_data = (uint32_t) data;
+		}
+
+		uint32_t data = mode == OCT_DATA_ZERO ? 0 : last_data;
+		node.flags = ((uint32_t)(tag & 0x2) << 30) | ((uint32_t)(tag & 0x4) << 28) | ((uint32_t)((tag >> 3) & 0x3) << 28) | data;
+
+		if (has_childs)
+		{
+			next_child = (uint64_t) node.first_child + node.child_count();
+
+			// The child block has to be inside the node array
+			if (next_child > octree.m_Nodes.size())
+				return false;
+		}
+
+		if (has_lods)
+		{
+			uint32_t lod = 0;
+			if (has_childs)
+			{
+				if (block_end - block < (ptrdiff_t) sizeof(uint32_t))
+					return false;
+
+				memcpy(&lod, block, sizeof(uint32_t));
+				block += sizeof(uint32_t);
+			}
+			octree.m_LodColors[i] = lod;
+		}
+	}
+
+	return true;
+}
+
+void Loader::load_chunk(std::fstream& file, u_shortV3& size, std::vector<Voxel>& voxels)
 {
 	// Chunk Info
 	char chunk_id[4];
@@ -237,13 +772,10 @@ void Loader::load_chunk(std::fstream& file, Octree& octree)
 	file.read((char*) &size_y, sizeof(size_y));
 	file.read((char*) &size_z, sizeof(size_z));
 
-	octree.init(size_x, size_z, size_y);
-
 	// XYZI
 	file.read((char*) &buffer, sizeof(buffer)); // XYZI
 
 	int num_voxels;
-	unsigned char x, y, z, color_id;
 
 	file.read((char*) &num_voxels, sizeof(num_voxels));
 
@@ -252,13 +784,23 @@ void Loader::load_chunk(std::fstream& file, Octree& octree)
 
 	num_voxels -= 4;
 
-	for (int j = 0; j < num_voxels; j += 4)
-	{
-		file.read((char*) &x, sizeof(x));
-		file.read((char*) &y, sizeof(y));
-		file.read((char*) &z, sizeof(z));
-		file.read((char*) &color_id, sizeof(color_id));
+	// x | y | z | color_id
+	std::vector<unsigned char> xyzi(num_voxels);
+	file.read((char*) xyzi.data(), num_voxels);
 
-		octree.insert_node(x, z, y, Loader::PALETTE[color_id]);
+	voxels.resize(num_voxels / 4);
+	for (int j = 0; j < voxels.size(); j++)
+	{
+		unsigned char* v = &xyzi[j * 4];
+		voxels[j] = { v[0], v[2], v[1], v[3] }; // Palette index as material
 	}
+
+	size = { (uint16_t) size_x, (uint16_t) size_z, (uint16_t) size_y };
+}
+
+void Loader::load_palette(std::vector<Material>& materials)
+{
+	materials.resize(256);
+	for (uint32_t i = 0; i < 256; i++)
+		materials[i] = { Utils::DataToColor(PALETTE[i]) };
 }
@@ -1,24 +1,68 @@
 #pragma once
 #include "../data_structs/Octree.h"
+#include "../data_structs/Tree64.h"
 
 #include <fstream>
 #include "../Camera.h"
 
+// .oct v2 header, followed by node_count OctreeNodes and, with OCT_LODS, node_count LOD colours.
+// With OCT_COMPRESSED the nodes and LOD colours are replaced by the encoded blocks.
+// Optional sections (ROPE, MATL, DIST) come last, MATL counts bytes so a different Material layout is caught.
+// v1 files start with the node count instead of the magic.
+struct OctHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t node_count;
+	u_shortV3 size;
+	uint8_t max_depth;
+	uint8_t flags;
+};
+
 class Loader
 {
 public:
+	static constexpr char OCT_MAGIC[4] = { 'V', 'O', 'C', 'T' };
+	static constexpr uint32_t OCT_VERSION = 2;
+
+	// OctHeader::flags
+	static constexpr uint8_t OCT_LODS = 1;
+	static constexpr uint8_t OCT_COMPRESSED = 2;
+
+	// Nodes per compressed block, every block decodes on its own
+	static constexpr uint32_t OCT_BLOCK_NODES = 1 << 16;
+
 	static Octree* load_vox(const char* file_name, std::vector<Octree>& octrees);
 
+	static bool load_vox(const char* file_name, Tree64& tree);
+
 	static Octree* load_oct(const char* file_name, std::vector<Octree>& octrees);
 
+	// Zero-copy load of a .oct v2 file, the nodes are traversed in the mapped file
+	static Octree* map_oct(const char* file_name, std::vector<Octree>& octrees);
+
 	static void load_scene(const char* file_name, Camera& camera, bool& render_light, bool& render_normal);
 
-	static void dump_oct(const char* file_name, Octree& octree);
+	// Compressed files are several times smaller, bounds are dropped and rebuilt on load
+	static void dump_oct(const char* file_name, Octree& octree, bool compressed = false);
 
 	static void dump_scene(const char* file_name, Camera& camera, bool& render_light, bool& render_normal);
 
 private:
-	static void load_chunk(std::fstream& file, Octree& octree);
+	// v1 nodes, stored field by field. False on a truncated file.
+	static bool load_oct_nodes_v1(std::fstream& file, size_t file_size, Octree& octree);
+
+	// Nodes [start, end) as a tag byte per node and varints for the child offset and data,
+	// both predicted from the previous node of the block
+	static void encode_oct_block(Octree& octree, uint32_t start, uint32_t end, std::vector<uint8_t>& block);
+
+	// False when the block ends early or points outside the node array
+	static bool decode_oct_block(const uint8_t* block, const uint8_t* block_end, Octree& octree, uint32_t start, uint32_t end, bool has_lods);
+
+	static void load_chunk(std::fstream& file, u_shortV3& size, std::vector<Voxel>& voxels);
+
+	// Default MagicaVoxel palette, indexed by the voxel colour id
+	static void load_palette(std::vector<Material>& materials);
 
 public:
 	static const uint32_t PALETTE[256];
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Copy-on-write mapping of a whole file. Pages are faulted in lazily by the OS and
+// stay shared with the page cache (and other processes) until they are written.
+class MappedFile
+{
+public:
+	MappedFile(const char* file_name);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool IsOpen() const { return m_Data != nullptr; }
+
+	uint8_t* GetData() const { return m_Data; }
+	size_t GetSize() const { return m_Size; }
+
+private:
+	uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+
+#ifdef _WIN32
+	void* m_File = nullptr;
+	void* m_Mapping = nullptr;
+#endif
+};
+
+// Contiguous array that is either owned, like std::vector, or a view into a MappedFile.
+// Writing an element of a view stays private to this process, anything that changes
+// the size copies the view into owned storage first.
+template<typename T>
+class MappedArray
+{
+public:
+	MappedArray() = default;
+
+	MappedArray(const MappedArray& other)
+		: m_Owned(other.begin(), other.end()) { sync(); }
+
+	MappedArray(MappedArray&& other) noexcept
+		: m_Owned(std::move(other.m_Owned)), m_File(std::move(other.m_File)), m_Data(other.m_Data), m_Size(other.m_Size)
+	{
+		other.m_Data = nullptr;
+		other.m_Size = 0;
+	}
+
+	MappedArray& operator=(const MappedArray& other)
+	{
+		if (this != &other)
+		{
+			m_File.reset();
+			m_Owned.assign(other.begin(), other.end());
+			sync();
+		}
+		return *this;
+	}
+
+	MappedArray& operator=(MappedArray&& other) noexcept
+	{
+		m_Owned = std::move(other.m_Owned);
+		m_File = std::move(other.m_File);
+		m_Data = other.m_Data;
+		m_Size = other.m_Size;
+		other.m_Data = nullptr;
+		other.m_Size = 0;
+		return *this;
+	}
+
+	MappedArray& operator=(std::vector<T>&& values)
+	{
+		m_File.reset();
+		m_Owned = std::move(values);
+		sync();
+		return *this;
+	}
+
+	// View count elements at offset bytes into file, nothing is copied
+	void view(const std::shared_ptr<MappedFile>& file, size_t offset, size_t count)
+	{
+		m_Owned.clear();
+		m_Owned.shrink_to_fit();
+		m_File = file;
+		m_Data = (T*) (file->GetData() + offset);
+		m_Size = count;
+	}
+
+	bool is_mapped() const { return m_File != nullptr; }
+
+	size_t size() const { return m_Size; }
+	bool empty() const { return m_Size == 0; }
+
+	T* data() { return m_Data; }
+	const T* data() const { return m_Data; }
+
+	T* begin() { return m_Data; }
+	T* end() { return m_Data + m_Size; }
+	const T* begin() const { return m_Data; }
+	const T* end() const { return m_Data + m_Size; }
+
+	T& operator[](size_t i) { return m_Data[i]; }
+	const T& operator[](size_t i) const { return m_Data[i]; }
+
+	void clear()
+	{
+		m_File.reset();
+		m_Owned.clear();
+		sync();
+	}
+
+	void reserve(size_t count)
+	{
+		detach();
+		m_Owned.reserve(count);
+		sync();
+	}
+
+	void shrink_to_fit()
+	{
+		detach();
+		m_Owned.shrink_to_fit();
+		sync();
+	}
+
+	void resize(size_t count)
+	{
+		detach();
+		m_Owned.resize(count);
+		sync();
+	}
+
+	void resize(size_t count, const T& value)
+	{
+		detach();
+		m_Owned.resize(count, value);
+		sync();
+	}
+
+	void assign(size_t count, const T& value)
+	{
+		m_File.reset();
+		m_Owned.assign(count, value);
+		sync();
+	}
+
+	void push_back(const T& value)
+	{
+		detach();
+		m_Owned.push_back(value);
+		sync();
+	}
+
+	template<typename... Args>
+	T& emplace_back(Args&&... args)
+	{
+		detach();
+		T& value = m_Owned.emplace_back(std::forward<Args>(args)...);
+		sync();
+		return value;
+	}
+
+	template<typename It>
+	void insert(T* pos, It first, It last)
+	{
+		size_t idx = pos - m_Data;
+		detach();
+		m_Owned.insert(m_Owned.begin() + idx, first, last);
+		sync();
+	}
+
+	void erase(T* pos)
+	{
+		erase(pos, pos + 1);
+	}
+
+	void erase(T* first, T* last)
+	{
+		size_t from = first - m_Data, to = last - m_Data;
+		detach();
+		m_Owned.erase(m_Owned.begin() + from, m_Owned.begin() + to);
+		sync();
+	}
+
+private:
+	void detach()
+	{
+		if (!m_File)
+			return;
+
+		m_Owned.assign(m_Data, m_Data + m_Size);
+		m_File.reset();
+	}
+
+	void sync()
+	{
+		m_Data = m_Owned.data();
+		m_Size = m_Owned.size();
+	}
+
+private:
+	std::vector<T> m_Owned;
+	std::shared_ptr<MappedFile> m_File;
+	T* m_Data = nullptr;
+	size_t m_Size = 0;
+};
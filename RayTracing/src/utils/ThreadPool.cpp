@@ -0,0 +1,148 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+static thread_local int s_WorkerQueue = -1;
+
+ThreadPool::ThreadPool(uint32_t num_threads)
+	: m_QueuedTasks(0), m_Stop(false)
+{
+	uint32_t num_workers = std::max(num_threads, 1u) - 1;
+
+	m_Queues.reserve(num_workers);
+	for (uint32_t i = 0; i < num_workers; i++)
+		m_Queues.push_back(std::make_unique<WorkQueue>());
+
+	m_Workers.reserve(num_workers);
+	for (uint32_t i = 0; i < num_workers; i++)
+		m_Workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_WakeMutex);
+		m_Stop = true;
+	}
+	m_WakeCondition.notify_all();
+
+	for (auto& worker : m_Workers)
+		worker.join();
+}
+
+void ThreadPool::ParallelFor(uint32_t count, const std::function<void(uint32_t)>& job)
+{
+	if (count == 0)
+		return;
+
+	// No workers, run inline
+	if (m_Queues.size() == 0)
+	{
+		for (uint32_t i = 0; i < count; i++)
+			job(i);
+		return;
+	}
+
+	Batch batch;
+	batch.Job = &job;
+	batch.Remaining = count;
+
+	// Hand out contiguous runs so neighbouring tasks start on the same worker
+	m_QueuedTasks += count;
+
+	uint32_t num_queues = (uint32_t) m_Queues.size();
+	for (uint32_t q = 0; q < num_queues; q++)
+	{
+		uint32_t start = (uint32_t) ((uint64_t) count * q / num_queues);
+		uint32_t end = (uint32_t) ((uint64_t) count * (q + 1) / num_queues);
+		if (start == end)
+			continue;
+
+		std::lock_guard<std::mutex> lock(m_Queues[q]->Mutex);
+		for (uint32_t i = start; i < end; i++)
+			m_Queues[q]->Tasks.push_back({ &batch, i });
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_WakeMutex);
+	}
+	m_WakeCondition.notify_all();
+
+	// Help until the batch is done
+	uint32_t own_queue = s_WorkerQueue == -1 ? 0 : s_WorkerQueue;
+
+	Task task;
+	while (batch.Remaining.load(std::memory_order_acquire) > 0)
+	{
+		if (PopTask(own_queue, task))
+			RunTask(task);
+		else
+			std::this_thread::yield();
+	}
+}
+
+ThreadPool& ThreadPool::Get()
+{
+	static ThreadPool s_Instance(std::thread::hardware_concurrency());
+	return s_Instance;
+}
+
+void ThreadPool::WorkerLoop(uint32_t queue)
+{
+	s_WorkerQueue = queue;
+
+	Task task;
+	while (true)
+	{
+		if (PopTask(queue, task))
+		{
+			RunTask(task);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_WakeMutex);
+		m_WakeCondition.wait(lock, [this]() { return m_Stop || m_QueuedTasks > 0; });
+
+		if (m_Stop)
+			return;
+	}
+}
+
+bool ThreadPool::PopTask(uint32_t queue, Task& task)
+{
+	// Own queue from the front
+	{
+		WorkQueue& own = *m_Queues[queue];
+		std::lock_guard<std::mutex> lock(own.Mutex);
+		if (own.Tasks.size() > 0)
+		{
+			task = own.Tasks.front();
+			own.Tasks.pop_front();
+			m_QueuedTasks--;
+			return true;
+		}
+	}
+
+	// Steal from the back of the others
+	uint32_t num_queues = (uint32_t) m_Queues.size();
+	for (uint32_t i = 1; i < num_queues; i++)
+	{
+		WorkQueue& victim = *m_Queues[(queue + i) % num_queues];
+		std::lock_guard<std::mutex> lock(victim.Mutex);
+		if (victim.Tasks.size() > 0)
+		{
+			task = victim.Tasks.back();
+			victim.Tasks.pop_back();
+			m_QueuedTasks--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void ThreadPool::RunTask(Task& task)
+{
+	(*task.Owner->Job)(task.Index);
+	task.Owner->Remaining.fetch_sub(1, std::memory_order_release);
+}
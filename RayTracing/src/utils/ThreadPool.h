@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent work-stealing pool: every worker owns a deque, pops from its front
+// and steals from the back of the others once its own work runs out.
+class ThreadPool
+{
+public:
+	// num_threads counts the calling thread, so num_threads - 1 workers are spawned
+	ThreadPool(uint32_t num_threads);
+	~ThreadPool();
+
+	// Run job(i) for every i in [0, count) and block until all are done.
+	// The calling thread executes tasks too, so nested calls are safe.
+	void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& job);
+
+	uint32_t GetThreadCount() const { return (uint32_t) m_Workers.size() + 1; }
+
+	static ThreadPool& Get();
+
+private:
+	struct Batch
+	{
+		const std::function<void(uint32_t)>* Job;
+		std::atomic<uint32_t> Remaining;
+	};
+
+	struct Task
+	{
+		Batch* Owner;
+		uint32_t Index;
+	};
+
+	struct WorkQueue
+	{
+		std::mutex Mutex;
+		std::deque<Task> Tasks;
+	};
+
+	void WorkerLoop(uint32_t queue);
+
+	bool PopTask(uint32_t queue, Task& task);
+
+	void RunTask(Task& task);
+
+private:
+	std::vector<std::thread> m_Workers;
+	std::vector<std::unique_ptr<WorkQueue>> m_Queues;
+
+	std::mutex m_WakeMutex;
+	std::condition_variable m_WakeCondition;
+
+	std::atomic<uint32_t> m_QueuedTasks;
+	std::atomic<bool> m_Stop;
+};
@@ -1,5 +1,7 @@
 #include "Utils.h"
+#include "ThreadPool.h"
 
+#include <array>
 #include <utility>
 
 uint32_t Utils::Vec4ToRGBA(const glm::vec4& color)
@@ -22,6 +24,24 @@ glm::vec3 Utils::IntToVec3Color(int color)
 	);
 }
 
+glm::vec3 Utils::DataToColor(uint32_t data)
+{
+	return glm::vec3(
+		((data >> 16) & 0xFF) / 255.0f,
+		((data >> 8) & 0xFF) / 255.0f,
+		(data & 0xFF) / 255.0f
+	);
+}
+
+uint32_t Utils::ColorToData(const glm::vec3& color)
+{
+	uint8_t r = (uint8_t)(color.r * 255.0f + 0.5f);
+	uint8_t g = (uint8_t)(color.g * 255.0f + 0.5f);
+	uint8_t b = (uint8_t)(color.b * 255.0f + 0.5f);
+
+	return (r << 16) | (g << 8) | b;
+}
+
 glm::vec3 Utils::Lighting(const glm::vec3& norm, const glm::vec3& pos, const glm::vec3& rd, const glm::vec3& col)
 {
 	glm::vec3 lightDir = glm::normalize(glm::vec3(-1.0, 3.0, -1.0));
@@ -100,6 +120,20 @@ void Utils::UnionAABBs(glm::vec3& source_min, glm::vec3& source_max, const glm::
 	source_max.z = glm::max(source_max.z, other.z);
 }
 
+void Utils::TransformAABB(const glm::mat4& transform, const glm::vec3& min, const glm::vec3& max, glm::vec3& out_min, glm::vec3& out_max)
+{
+	out_min = glm::vec3(FLT_MAX);
+	out_max = glm::vec3(-FLT_MAX);
+
+	for (uint8_t i = 0; i < 8; i++)
+	{
+		glm::vec3 corner = { i & 1 ? max.x + 1 : min.x, i & 2 ? max.y + 1 : min.y, i & 4 ? max.z + 1 : min.z };
+		UnionAABBs(out_min, out_max, glm::vec3(transform * glm::vec4(corner, 1.0f)));
+	}
+
+	out_max -= glm::vec3(1);
+}
+
 uint8_t Utils::MaxExtension(const glm::vec3& min, const glm::vec3& max)
 {
 	if (max.x - min.x > max.y - min.y)
@@ -115,3 +149,51 @@ float Utils::SurfaceArea(const glm::vec3& min, const glm::vec3& max)
 	glm::vec3 d = max - min;
 	return 2.f * (d.x * d.y + d.x * d.z + d.y * d.z);
 }
+
+void Utils::RadixSort(std::vector<std::pair<uint64_t, uint32_t>>& items, uint8_t key_bits)
+{
+	std::vector<std::pair<uint64_t, uint32_t>> temp(items.size());
+
+	// Every chunk counts and scatters its own slice, the offsets are laid out digit major
+	// and chunk minor so equal keys keep their order
+	ThreadPool& pool = ThreadPool::Get();
+	const uint32_t min_chunk = 1 << 14;
+	uint32_t size = (uint32_t) items.size();
+	uint32_t chunks = std::max(1u, std::min(pool.GetThreadCount() * 4, size / min_chunk));
+	uint32_t chunk_size = (size + chunks - 1) / chunks;
+
+	std::vector<std::array<uint32_t, 256>> offsets(chunks);
+
+	for (uint8_t shift = 0; shift < key_bits; shift += 8)
+	{
+		pool.ParallelFor(chunks, [&](uint32_t chunk) {
+			std::array<uint32_t, 256>& counts = offsets[chunk];
+			counts.fill(0);
+
+			uint32_t end = std::min((chunk + 1) * chunk_size, size);
+			for (uint32_t i = chunk * chunk_size; i < end; i++)
+				counts[(items[i].first >> shift) & 0xFF]++;
+		});
+
+		uint32_t sum = 0;
+		for (uint32_t digit = 0; digit < 256; digit++)
+		{
+			for (std::array<uint32_t, 256>& counts : offsets)
+			{
+				uint32_t count = counts[digit];
+				counts[digit] = sum;
+				sum += count;
+			}
+		}
+
+		pool.ParallelFor(chunks, [&](uint32_t chunk) {
+			std::array<uint32_t, 256>& chunk_offsets = offsets[chunk];
+
+			uint32_t end = std::min((chunk + 1) * chunk_size, size);
+			for (uint32_t i = chunk * chunk_size; i < end; i++)
+				temp[chunk_offsets[(items[i].first >> shift) & 0xFF]++] = items[i];
+		});
+
+		items.swap(temp);
+	}
+}
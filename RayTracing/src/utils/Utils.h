@@ -4,12 +4,17 @@
 
 #include <glm/glm.hpp>
 
+#include <vector>
+
 class Utils
 {
 public:
 	static uint32_t Vec4ToRGBA(const glm::vec4& color);
 	
 	static glm::vec3 IntToVec3Color(int color);
+
+	static glm::vec3 DataToColor(uint32_t data);
+	static uint32_t ColorToData(const glm::vec3& color);
 	
 	static glm::vec3 Lighting(const glm::vec3& norm, const glm::vec3& pos, const glm::vec3& rd, const glm::vec3& col);
 
@@ -21,7 +26,14 @@ public:
 
 	static void UnionAABBs(glm::vec3& source_min, glm::vec3& source_max, const glm::vec3& other);
 
+	// Inclusive voxel bounds, the box spans [min, max + 1) before and after the transform
+	static void TransformAABB(const glm::mat4& transform, const glm::vec3& min, const glm::vec3& max, glm::vec3& out_min, glm::vec3& out_max);
+
 	static uint8_t MaxExtension(const glm::vec3& min, const glm::vec3& max);
 
 	static float Utils::SurfaceArea(const glm::vec3& min, const glm::vec3& max);
+
+	// Stable LSD radix sort by key, only the lowest key_bits are considered.
+	// Large inputs are counted and scattered in parallel chunks
+	static void RadixSort(std::vector<std::pair<uint64_t, uint32_t>>& items, uint8_t key_bits);
 };